@@ -0,0 +1,67 @@
+#!/bin/bash
+#
+# Benchmark conversion throughput, container codec throughput and
+# pack/unpack times. Results are written as CSV files to ${BENCH_OUT}.
+#
+# BENCH_CORPUS  Directory of songs to convert (default: test-songs)
+# BENCH_JOBS    Number of files to convert in parallel (default: 1)
+# BENCH_OUT     Directory for CSV files (default: bench-output)
+
+RMC="$(pwd)/rmc"
+CORPUS="${BENCH_CORPUS:-test-songs}"
+JOBS="${BENCH_JOBS:-1}"
+OUT="${BENCH_OUT:-bench-output}"
+
+set -e
+
+now() {
+    date +%s.%N
+}
+
+elapsed() {
+    awk -v a="$1" -v b="$2" 'BEGIN {printf "%.6f", b - a}'
+}
+
+work=$(mktemp -d)
+trap 'rm -rf "${work}"' EXIT
+mkdir -p "${OUT}"
+
+echo "Benchmark conversion of ${CORPUS} with ${JOBS} jobs"
+# Convert a copy so that the corpus is not modified. Old containers are
+# removed so that every run converts the same files.
+mkdir "${work}/corpus"
+cp -r "${CORPUS}/." "${work}/corpus/"
+find "${work}/corpus" -name '*.rmc' -delete
+nfiles=$(find "${work}/corpus" -type f | wc -l)
+start=$(now)
+"${RMC}" -j "${JOBS}" --stats-fd=3 "${work}/corpus" \
+	 3>"${work}/stats.json" >/dev/null 2>&1 || true
+end=$(now)
+emulated_ms=$(sed -n 's/.*"emulated_ms": \([0-9]*\), "user_cpu_ms".*/\1/p' \
+		  "${work}/stats.json" | awk '{s += $1} END {print s + 0}')
+echo "files,jobs,seconds,files_per_s,emulated_s,emulated_s_per_s" \
+     > "${OUT}/conversion.csv"
+awk -v n="${nfiles}" -v j="${JOBS}" -v t="$(elapsed "${start}" "${end}")" \
+    -v e="${emulated_ms}" \
+    'BEGIN {printf "%d,%d,%.3f,%.3f,%.3f,%.3f\n", n, j, t, n / t, e / 1000, e / 1000 / t}' \
+    >> "${OUT}/conversion.csv"
+cat "${OUT}/conversion.csv"
+
+echo "Benchmark container codec"
+"${RMC}" --bench-codec > "${OUT}/codec.csv"
+cat "${OUT}/codec.csv"
+
+echo "Benchmark pack and unpack"
+echo "file,bytes,unpack_s,pack_s" > "${OUT}/pack.csv"
+find "${work}/corpus" -name '*.rmc' | sort | while read -r rmc ; do
+    rm -rf "${work}/unpacked"
+    mkdir "${work}/unpacked"
+    start=$(now)
+    "${RMC}" -u "${work}/unpacked" "${rmc}" 2>/dev/null
+    middle=$(now)
+    "${RMC}" -p "${work}/unpacked" "${work}/packed.rmc" >/dev/null 2>&1
+    end=$(now)
+    echo "$(basename "${rmc}"),$(stat -c %s "${rmc}"),$(elapsed "${start}" "${middle}"),$(elapsed "${middle}" "${end}")" \
+	 >> "${OUT}/pack.csv"
+done
+cat "${OUT}/pack.csv"
@@ -14,6 +14,9 @@ META_FORMAT = {
     OPTIONAL_KEY(b'format'): bytes,
     OPTIONAL_KEY(b'title'): bytes,
     OPTIONAL_KEY(b'authors'): [ONE_OR_MORE, bytes],
+    OPTIONAL_KEY(b'estimated_subsongs'): [ONE_OR_MORE, int],
+    OPTIONAL_KEY(b'file_hashes'): {bytes: bytes},
+    OPTIONAL_KEY(b'stored_files'): [ONE_OR_MORE, bytes],
     OPTIONAL_KEY(b'year'): bytes,
     OPTIONAL_KEY(b'song'): bytes,
     OPTIONAL_KEY(b'comment'): bytes,
@@ -25,6 +28,9 @@ META_FORMAT = {
 
 FILES_FORMAT = {bytes: bytes}
 
+# Keys of rmc --store, which grow with the number of files
+STORE_KEYS = (b'file_hashes', b'stored_files')
+
 
 class RMC:
     def __init__(self, data: bytes = None):
@@ -73,7 +79,9 @@ def _process(fname, md5_to_meta):
     _modland_check(fname, rmc, md5_to_meta)
     rmc.validate()
 
-    assert len(bencode.bencode(rmc.get_meta())) < META_MAX_SIZE
+    meta = {key: value for key, value in rmc.get_meta().items()
+            if key not in STORE_KEYS}
+    assert len(bencode.bencode(meta)) < META_MAX_SIZE
 
     new_data = rmc.serialize()
     if new_data != data:
@@ -1,3 +1,6 @@
+/* For RUSAGE_THREAD */
+#define _GNU_SOURCE
+
 #include <uade/uade.h>
 #include <bencodetools/bencode.h>
 #include <zakalwe/base.h>
@@ -6,42 +9,143 @@
 #include <zakalwe/string.h>
 
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
-#include <ftw.h>
+#include <fcntl.h>
 #include <getopt.h>
-#include <iconv.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <linux/stat.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
 #define FREQUENCY 44100
+#define SILENCE_TIMEOUT 20
+
+/* Bump this when cached conversion results become invalid */
+#define CACHE_VERSION 3
+
+/* --repack modes */
+#define REPACK_META 1
+#define REPACK_FULL 2
 
 static int subsong_timeout = 512;
 static int delete_after_packing = 0;
 static int recursive_mode = 0;
 static int overwrite_mode = 1;
 static int repack_mode = 0;
+static int njobs = 1;
+static mode_t file_create_mode = 0644;
+static int subsong_jobs = 1;
+static int switch_subsongs = 0;
+static const char *cache_dir;
+static const char *store_dir;
+static int loop_confirm_time = 0;
+static double silence_window = 0;
+static int silence_threshold = 16;
+static double file_budget = 0;
+static double batch_budget = 0;
+static double batch_budget_left;
+static pthread_mutex_t batch_budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *stats_file;
+static size_t file_cache_size = 64 << 20;
+static int use_io_uring = 1;
+static int use_file_index = 1;
+static const char *unpack_entry;
+
+
+/* uade_new_state() reads global config files. Create states serially. */
+static pthread_mutex_t uade_state_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Per-file timing statistics (--stats-fd). Times are wall-clock seconds
+ * from a monotonic clock. collect is the time spent loading and recording
+ * files in collect_files(). It overlaps detect and the subsong times,
+ * because uade loads files while it plays. CPU usage is that of the
+ * converting thread. It does not include the uadecore process that runs
+ * the emulation.
+ */
+struct subsong_stats {
+	int subsong;
+	double wall;
+	double emulated;
+};
+
+struct file_stats {
+	const char *result;
+	double start;
+	double load;
+	double detect;
+	double collect;
+	double encode;
+	double write;
+	/* Emulator initializations saved by reusing a running session */
+	int reinits_avoided;
+	struct rusage rusage;
+	struct subsong_stats *subsongs;
+	size_t nsubsongs;
+	size_t allocated;
+};
 
-static struct bencode *scanner_file_list;
+/*
+ * A worker converts files from the scanner list with its own uade state.
+ * In parallel mode (-j N) the progress messages of each file are buffered
+ * into log and written to stderr as one block after the file is done, so
+ * that messages of different files do not interleave.
+ */
+struct worker {
+	int id;
+	const struct uade_config *config;
+	struct work_queue *queue;
+	struct uade_state *state;
+	FILE *log;
+	char *logbuf;
+	size_t logsize;
+	int exitval;
+	double loop_saved_time;
+	double simulated_time;
+	size_t max_subsong_bytes;  /* 0 if the subsong is not limited */
+	int subsong_estimated;
+	struct file_stats stats;
+	pthread_t thread;
+};
 
 struct collection_context {
 	struct bencode *container;
 	struct bencode *filelist;
+	struct worker *worker;
 };
 
-iconv_t iconv_cd;
 
+/* Monotonic time in seconds */
+static double gettime(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts))
+		z_die("clock_gettime() does not work\n");
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 static long long getmstime(void)
 {
-	struct timeval tv;
-	if (gettimeofday(&tv, NULL))
-		z_die("gettimeofday() does not work\n");
-	return ((long long) tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+	return (long long) (gettime() * 1000);
 }
 
 static size_t xfwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
@@ -61,45 +165,865 @@ static size_t xfwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
         return written;
 }
 
+/*
+ * Directory walker. Directories are opened relative to their parent with
+ * openat() and read with readdir(), which reads entries in large getdents()
+ * batches and gives the file type without a stat() in most file systems.
+ * fn is called for each regular file. Symbolic links are followed, but a
+ * directory that is its own ancestor is skipped.
+ */
+typedef void (*walk_fn)(const char *path, void *context);
+
+struct walk_node {
+	dev_t dev;
+	ino_t ino;
+	const struct walk_node *parent;
+};
+
+static void walk_dir(int fd, char *path, size_t len,
+		     const struct walk_node *parent, walk_fn fn,
+		     void *context)
+{
+	DIR *dir = fdopendir(fd);
+	struct dirent *de;
+	const struct walk_node *ancestor;
+	struct walk_node node;
+	struct stat st;
+	size_t namelen;
+	int type;
+	int subfd;
+
+	if (dir == NULL) {
+		z_log_warning("Can not read directory %s (%s)\n", path,
+			      strerror(errno));
+		close(fd);
+		return;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+
+		namelen = strlen(de->d_name);
+		if (len + 1 + namelen >= PATH_MAX) {
+			path[len] = 0;
+			z_log_warning("Path too long in %s: %s\n", path,
+				      de->d_name);
+			continue;
+		}
+		path[len] = '/';
+		memcpy(path + len + 1, de->d_name, namelen + 1);
+
+		type = de->d_type;
+		if (type == DT_UNKNOWN || type == DT_LNK) {
+			if (fstatat(dirfd(dir), de->d_name, &st, 0)) {
+				z_log_warning("Can not stat %s (%s)\n", path,
+					      strerror(errno));
+				continue;
+			}
+			type = S_ISDIR(st.st_mode) ? DT_DIR :
+				S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		if (type == DT_REG) {
+			fn(path, context);
+		} else if (type == DT_DIR) {
+			subfd = openat(dirfd(dir), de->d_name,
+				       O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (subfd < 0 || fstat(subfd, &st)) {
+				z_log_warning("Can not open directory %s (%s)\n",
+					      path, strerror(errno));
+				if (subfd >= 0)
+					close(subfd);
+				continue;
+			}
+			for (ancestor = parent; ancestor != NULL;
+			     ancestor = ancestor->parent) {
+				if (ancestor->dev == st.st_dev &&
+				    ancestor->ino == st.st_ino)
+					break;
+			}
+			if (ancestor != NULL) {
+				z_log_warning("Skipping directory loop %s\n",
+					      path);
+				close(subfd);
+				continue;
+			}
+			node = (struct walk_node) {.dev = st.st_dev,
+						   .ino = st.st_ino,
+						   .parent = parent};
+			walk_dir(subfd, path, len + 1 + namelen, &node, fn,
+				 context);
+		}
+	}
+	path[len] = 0;
+	closedir(dir);
+}
+
+/* Call fn for each regular file under directory root. */
+static int walk_tree(const char *root, walk_fn fn, void *context)
+{
+	char path[PATH_MAX];
+	struct walk_node node;
+	struct stat st;
+	size_t len = strlen(root);
+	int fd;
+
+	if (len >= sizeof path)
+		return -1;
+	memcpy(path, root, len + 1);
+	/* Avoid double slashes in file names */
+	while (len > 1 && path[len - 1] == '/')
+		path[--len] = 0;
+
+	fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	node = (struct walk_node) {.dev = st.st_dev, .ino = st.st_ino};
+	walk_dir(fd, path, len, &node, fn, context);
+	return 0;
+}
+
+static int has_rmc_suffix(const char *path)
+{
+	size_t len = strlen(path);
+	return len > 4 && strcasecmp(path + len - 4, ".rmc") == 0;
+}
+
+/* Returns 1 if path is named like a temp file of create_temp_file() */
+static int is_temp_file_name(const char *path)
+{
+	const char *bname = strrchr(path, '/');
+	size_t len;
+
+	bname = bname != NULL ? bname + 1 : path;
+	len = strlen(bname);
+	return len >= 9 && bname[0] == '.' && bname[len - 7] == '.' &&
+		strspn(bname + len - 6, "abcdefghijklmnopqrstuvwxyz"
+		       "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789") == 6;
+}
+
+/*
+ * Bounded queue of file names from the directory scanner to the workers.
+ * Conversion starts while the scanner is still walking directories. When
+ * a batch budget is used, the workers wait until the scan is complete,
+ * because the budget is shared by the number of files.
+ */
+#define WORK_QUEUE_SIZE 4096
+
+struct work_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	void **items;
+	size_t capacity;
+	size_t head;
+	size_t count;
+	int bounded;
+	int done;
+};
+
+static void work_queue_init(struct work_queue *queue, int bounded)
+{
+	*queue = (struct work_queue) {.capacity = WORK_QUEUE_SIZE,
+				      .bounded = bounded};
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+	queue->items = calloc(queue->capacity, sizeof queue->items[0]);
+	if (queue->items == NULL)
+		z_die("No memory for work queue\n");
+}
+
+static void work_queue_free(struct work_queue *queue)
+{
+	assert(queue->count == 0);
+	free(queue->items);
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_cond_destroy(&queue->not_full);
+}
+
+static void work_queue_grow(struct work_queue *queue)
+{
+	void **items = calloc(2 * queue->capacity, sizeof items[0]);
+	size_t i;
+	if (items == NULL)
+		z_die("No memory for work queue\n");
+	for (i = 0; i < queue->count; i++)
+		items[i] = queue->items[(queue->head + i) % queue->capacity];
+	free(queue->items);
+	queue->items = items;
+	queue->capacity *= 2;
+	queue->head = 0;
+}
+
+static void work_queue_add(struct work_queue *queue, void *item)
+{
+	pthread_mutex_lock(&queue->lock);
+	while (queue->bounded && queue->count == queue->capacity)
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+	if (queue->count == queue->capacity)
+		work_queue_grow(queue);
+	queue->items[(queue->head + queue->count) % queue->capacity] = item;
+	queue->count++;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/* Queue a copy of path. This is a walk_fn. */
+static void work_queue_push(const char *path, void *context)
+{
+	char *copy = strdup(path);
+	if (copy == NULL)
+		z_die("No memory to queue file %s\n", path);
+	work_queue_add(context, copy);
+}
+
+static void work_queue_finish(struct work_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->done = 1;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/* Returns the next item, or NULL when all items have been taken */
+static void *work_queue_pop(struct work_queue *queue)
+{
+	void *item = NULL;
+	pthread_mutex_lock(&queue->lock);
+	while (!queue->done && (queue->count == 0 || !queue->bounded))
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	if (queue->count > 0) {
+		item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		pthread_cond_signal(&queue->not_full);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return item;
+}
+
+/* Number of files left in the queue */
+static size_t work_queue_len(struct work_queue *queue)
+{
+	size_t count;
+	pthread_mutex_lock(&queue->lock);
+	count = queue->count;
+	pthread_mutex_unlock(&queue->lock);
+	return count;
+}
+
+/* 128-bit MurmurHash3 (x64 variant) for content addressing */
+struct rmc_hash {
+	uint64_t h[2];
+};
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static inline uint64_t load_le64(const uint8_t *p)
+{
+	return ((uint64_t) p[0]) | ((uint64_t) p[1] << 8) |
+		((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24) |
+		((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) |
+		((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+static inline uint32_t load_le32(const uint8_t *p)
+{
+	return ((uint32_t) p[0]) | ((uint32_t) p[1] << 8) |
+		((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void put_le32(uint8_t *p, uint32_t x)
+{
+	size_t i;
+	for (i = 0; i < 4; i++)
+		p[i] = x >> (8 * i);
+}
+
+static void put_le64(uint8_t *p, uint64_t x)
+{
+	size_t i;
+	for (i = 0; i < 8; i++)
+		p[i] = x >> (8 * i);
+}
+
+static void rmc_hash(struct rmc_hash *hash, const void *key, size_t len,
+		     uint64_t seed)
+{
+	const uint8_t *data = key;
+	const uint8_t *tail = data + (len & ~((size_t) 15));
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = seed;
+	uint64_t h2 = seed;
+	uint64_t k1;
+	uint64_t k2;
+
+	for (; data < tail; data += 16) {
+		k1 = load_le64(data);
+		k2 = load_le64(data + 8);
+
+		k1 *= c1;
+		k1 = rotl64(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+		h1 = rotl64(h1, 27);
+		h1 += h2;
+		h1 = h1 * 5 + 0x52dce729;
+
+		k2 *= c2;
+		k2 = rotl64(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+		h2 = rotl64(h2, 31);
+		h2 += h1;
+		h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	k1 = 0;
+	k2 = 0;
+	switch (len & 15) {
+	case 15: k2 ^= ((uint64_t) tail[14]) << 48; /* fall through */
+	case 14: k2 ^= ((uint64_t) tail[13]) << 40; /* fall through */
+	case 13: k2 ^= ((uint64_t) tail[12]) << 32; /* fall through */
+	case 12: k2 ^= ((uint64_t) tail[11]) << 24; /* fall through */
+	case 11: k2 ^= ((uint64_t) tail[10]) << 16; /* fall through */
+	case 10: k2 ^= ((uint64_t) tail[9]) << 8; /* fall through */
+	case 9:
+		k2 ^= ((uint64_t) tail[8]);
+		k2 *= c2;
+		k2 = rotl64(k2, 33);
+		k2 *= c1;
+		h2 ^= k2;
+		/* fall through */
+	case 8: k1 ^= ((uint64_t) tail[7]) << 56; /* fall through */
+	case 7: k1 ^= ((uint64_t) tail[6]) << 48; /* fall through */
+	case 6: k1 ^= ((uint64_t) tail[5]) << 40; /* fall through */
+	case 5: k1 ^= ((uint64_t) tail[4]) << 32; /* fall through */
+	case 4: k1 ^= ((uint64_t) tail[3]) << 24; /* fall through */
+	case 3: k1 ^= ((uint64_t) tail[2]) << 16; /* fall through */
+	case 2: k1 ^= ((uint64_t) tail[1]) << 8; /* fall through */
+	case 1:
+		k1 ^= ((uint64_t) tail[0]);
+		k1 *= c1;
+		k1 = rotl64(k1, 31);
+		k1 *= c2;
+		h1 ^= k1;
+	}
+
+	h1 ^= len;
+	h2 ^= len;
+	h1 += h2;
+	h2 += h1;
+	h1 = fmix64(h1);
+	h2 = fmix64(h2);
+	h1 += h2;
+	h2 += h1;
+	hash->h[0] = h1;
+	hash->h[1] = h2;
+}
+
+/* hex must have room for 33 bytes */
+static void rmc_hash_to_hex(char *hex, const struct rmc_hash *hash)
+{
+	snprintf(hex, 33, "%016llx%016llx", (unsigned long long) hash->h[0],
+		 (unsigned long long) hash->h[1]);
+}
+
+/*
+ * Returns the number of ASCII bytes at the beginning of s. The scanner is
+ * vectorized with SSE2 or AVX2 where available, see init_simd().
+ */
+static size_t ascii_prefix_len_scalar(const char *s, size_t len)
+{
+	uint64_t word;
+	size_t i;
+
+	/* Check 8 bytes at a time */
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&word, s + i, 8);
+		if (word & 0x8080808080808080ULL)
+			break;
+	}
+	while (i < len && ((unsigned char) s[i]) < 0x80)
+		i++;
+	return i;
+}
+
+#ifdef HAVE_X86_SIMD
+/* The movemask of a byte vector has the high bits, set for non-ASCII */
+__attribute__((target("sse2")))
+static size_t ascii_prefix_len_sse2(const char *s, size_t len)
+{
+	size_t i;
+	int mask;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		mask = _mm_movemask_epi8(
+			_mm_loadu_si128((const __m128i *) (s + i)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + ascii_prefix_len_scalar(s + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t ascii_prefix_len_avx2(const char *s, size_t len)
+{
+	size_t i;
+	int mask;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		mask = _mm256_movemask_epi8(
+			_mm256_loadu_si256((const __m256i *) (s + i)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+	return i + ascii_prefix_len_scalar(s + i, len - i);
+}
+#endif
+
+static size_t (*ascii_prefix_len)(const char *s,
+				  size_t len) = ascii_prefix_len_scalar;
+
+/*
+ * Convert a Latin-1 string of len bytes to a UTF-8 bencode string.
+ * Returns NULL if out of memory.
+ */
+static struct bencode *latin1_to_utf8(const char *s, size_t len)
+{
+	const unsigned char *in = (const unsigned char *) s;
+	struct bencode *str;
+	unsigned char *utf8;
+	size_t n = ascii_prefix_len(s, len);
+	size_t i = n;
+	size_t run;
+
+	if (n == len)
+		return ben_blob(s, len);
+	if (len > SIZE_MAX / 2)
+		return NULL;
+	/* Each non-ASCII byte becomes two bytes */
+	utf8 = malloc(2 * len - n);
+	if (utf8 == NULL)
+		return NULL;
+	memcpy(utf8, s, n);
+	while (i < len) {
+		if (in[i] < 0x80) {
+			run = ascii_prefix_len(s + i, len - i);
+			memcpy(utf8 + n, s + i, run);
+			n += run;
+			i += run;
+			continue;
+		}
+		utf8[n++] = 0xc0 | (in[i] >> 6);
+		utf8[n++] = 0x80 | (in[i] & 0x3f);
+		i++;
+	}
+	str = ben_blob(utf8, n);
+	free(utf8);
+	return str;
+}
+
 static void set_str_by_str(struct bencode *d, const char *key,
 			   const char *value)
 {
-	char latin1[4096];
-	char utf8[4096];
-	size_t ret = strlcpy(latin1, value, sizeof(latin1));
-	// The size returned by strlcpy() does not contain the terminating '\0'
-	size_t inbytesleft = ret + 1;
-	size_t outbytesleft = sizeof(utf8);
-	char *in = latin1;
-	char *out = utf8;
-	z_assert(ret < sizeof(latin1));
+	struct bencode *str = latin1_to_utf8(value, strlen(value));
+	if (str == NULL || ben_dict_set_by_str(d, key, str))
+		z_die("Can not set %s to %s\n", key, value);
+}
+
+/* Returns 1 if s is valid UTF-8 without overlong forms and surrogates */
+static int is_valid_utf8(const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) s;
+	const unsigned char *end = p + len;
+	uint32_t c;
+	size_t n;
+	size_t i;
+
+	while (p < end) {
+		p += ascii_prefix_len((const char *) p, end - p);
+		if (p == end)
+			break;
+		c = *p++;
+		if (c >= 0xc2 && c <= 0xdf) {
+			n = 1;
+			c &= 0x1f;
+		} else if (c >= 0xe0 && c <= 0xef) {
+			n = 2;
+			c &= 0x0f;
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			n = 3;
+			c &= 0x07;
+		} else {
+			return 0;
+		}
+		if ((size_t) (end - p) < n)
+			return 0;
+		for (i = 0; i < n; i++) {
+			if ((p[i] & 0xc0) != 0x80)
+				return 0;
+			c = (c << 6) | (p[i] & 0x3f);
+		}
+		p += n;
+		if ((n == 2 && c < 0x800) || (n == 3 && c < 0x10000) ||
+		    c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Loop detection (-l t). The PCM stream is split into content-defined
+ * chunks with a gear rolling hash, so that chunk boundaries do not depend
+ * on the phase of the stream. Each chunk is fingerprinted. A loop is
+ * detected when the chunk sequence repeats with a fixed period, and the
+ * repeated part covers the whole period and lasts at least t seconds.
+ * Only bit-exact repetition of the output is accepted as a loop. The loop
+ * point is accurate to a few chunks, that is, tens of milliseconds.
+ */
+
+/* Average chunk is 4096 bytes, that is, 23 ms at 44.1 kHz */
+#define LOOP_CHUNK_MASK 0xfff
+#define LOOP_CHUNK_MIN 1024
+#define LOOP_CHUNK_MAX 16384
+
+/* Shorter periods are treated as drones or silence, not as loops */
+#define LOOP_MIN_PERIOD_TIME 1
+
+struct loop_chunk {
+	uint64_t hash;
+	size_t start;
+};
+
+struct loop_detector {
+	size_t bytespersecond;
+	uint64_t rolling;
+	uint8_t chunk[LOOP_CHUNK_MAX];
+	size_t chunklen;
+	size_t streampos;
+	struct loop_chunk *chunks;
+	size_t nchunks;
+	size_t allocated;
+	size_t *table;  /* latest chunk index + 1 by hash, 0 if empty */
+	size_t tablesize;
+	size_t period;  /* candidate period in chunks, 0 if none */
+	size_t runstart;
+	size_t loopstart;
+	size_t loopperiod;
+};
+
+static uint64_t gear_table[256];
+static pthread_once_t gear_table_once = PTHREAD_ONCE_INIT;
+
+static void init_gear_table(void)
+{
+	/* splitmix64 */
+	uint64_t x = 0;
+	uint64_t z;
+	size_t i;
+	for (i = 0; i < 256; i++) {
+		x += 0x9e3779b97f4a7c15ULL;
+		z = x;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear_table[i] = z ^ (z >> 31);
+	}
+}
+
+static void loop_detector_init(struct loop_detector *ld,
+			       size_t bytespersecond)
+{
+	pthread_once(&gear_table_once, init_gear_table);
+	memset(ld, 0, sizeof *ld);
+	ld->bytespersecond = bytespersecond;
+}
+
+static void loop_detector_free(struct loop_detector *ld)
+{
+	free(ld->chunks);
+	free(ld->table);
+	ld->chunks = NULL;
+	ld->table = NULL;
+}
+
+static size_t *loop_table_slot(struct loop_detector *ld, uint64_t hash,
+			       size_t *index)
+{
+	size_t mask = ld->tablesize - 1;
+	size_t i = hash & mask;
+	while (ld->table[i] != 0) {
+		if (ld->chunks[ld->table[i] - 1].hash == hash) {
+			*index = ld->table[i] - 1;
+			return &ld->table[i];
+		}
+		i = (i + 1) & mask;
+	}
+	*index = (size_t) -1;
+	return &ld->table[i];
+}
+
+static void loop_table_grow(struct loop_detector *ld)
+{
+	size_t *oldtable = ld->table;
+	size_t oldsize = ld->tablesize;
+	size_t index;
+	size_t i;
+
+	ld->tablesize = oldsize ? 2 * oldsize : 1024;
+	ld->table = calloc(ld->tablesize, sizeof ld->table[0]);
+	if (ld->table == NULL)
+		z_die("No memory for loop detection\n");
+	for (i = 0; i < oldsize; i++) {
+		if (oldtable[i] != 0) {
+			*loop_table_slot(ld, ld->chunks[oldtable[i] - 1].hash,
+					 &index) = oldtable[i];
+		}
+	}
+	free(oldtable);
+}
+
+/* Returns 1 when a loop has been confirmed */
+static int loop_detector_add_chunk(struct loop_detector *ld)
+{
+	struct rmc_hash chunkhash;
+	struct loop_chunk *c;
+	size_t *slot;
+	size_t i = ld->nchunks;
+	size_t j;
+	size_t periodbytes;
+
+	if (ld->nchunks == ld->allocated) {
+		ld->allocated = ld->allocated ? 2 * ld->allocated : 1024;
+		c = realloc(ld->chunks, ld->allocated * sizeof c[0]);
+		if (c == NULL)
+			z_die("No memory for loop detection\n");
+		ld->chunks = c;
+	}
+	if (2 * (ld->nchunks + 1) > ld->tablesize)
+		loop_table_grow(ld);
+
+	rmc_hash(&chunkhash, ld->chunk, ld->chunklen, 0);
+	c = &ld->chunks[i];
+	*c = (struct loop_chunk) {.hash = chunkhash.h[0],
+				  .start = ld->streampos - ld->chunklen};
+	ld->nchunks++;
+	ld->chunklen = 0;
+
+	if (ld->period != 0 && ld->chunks[i - ld->period].hash != c->hash)
+		ld->period = 0;
+
+	slot = loop_table_slot(ld, c->hash, &j);
+	if (ld->period == 0 && j != ((size_t) -1) &&
+	    (c->start - ld->chunks[j].start) >=
+	    LOOP_MIN_PERIOD_TIME * ld->bytespersecond) {
+		ld->period = i - j;
+		ld->runstart = i;
+	}
+	*slot = i + 1;
+
+	if (ld->period == 0)
+		return 0;
+
+	periodbytes = c->start - ld->chunks[i - ld->period].start;
+	if ((i - ld->runstart + 1) < ld->period ||
+	    (ld->streampos - ld->chunks[ld->runstart].start) <
+	    (size_t) loop_confirm_time * ld->bytespersecond)
+		return 0;
+
+	/*
+	 * The run may have started late if the same chunk appeared several
+	 * times within the loop. Find where the repetition really begins.
+	 */
+	while (ld->runstart > ld->period &&
+	       ld->chunks[ld->runstart - 1].hash ==
+	       ld->chunks[ld->runstart - 1 - ld->period].hash)
+		ld->runstart--;
+
+	ld->loopstart = ld->chunks[ld->runstart].start;
+	ld->loopperiod = periodbytes;
+	return 1;
+}
+
+/* Feed PCM data to the detector. Returns 1 when a loop has been confirmed. */
+static int loop_detector_feed(struct loop_detector *ld, const void *data,
+			      size_t len)
+{
+	const uint8_t *p = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		ld->rolling = (ld->rolling << 1) + gear_table[p[i]];
+		ld->chunk[ld->chunklen++] = p[i];
+		ld->streampos++;
+		if ((ld->chunklen >= LOOP_CHUNK_MIN &&
+		     (ld->rolling & LOOP_CHUNK_MASK) == 0) ||
+		    ld->chunklen == LOOP_CHUNK_MAX) {
+			if (loop_detector_add_chunk(ld))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Silence detection (--silence-window). The last audible frame of each
+ * buffer is searched by scanning 16-bit samples backwards for an amplitude
+ * above silence_threshold. The scanner is vectorized with SSE2 or AVX2
+ * where available.
+ */
+
+/*
+ * Returns the number of samples up to and including the last sample whose
+ * amplitude exceeds threshold, or 0 if all samples are silent.
+ */
+static size_t last_audible_scalar(const int16_t *samples, size_t n,
+				  int threshold)
+{
+	while (n > 0) {
+		int x = samples[n - 1];
+		if (x > threshold || x < -threshold)
+			return n;
+		n--;
+	}
+	return 0;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static size_t last_audible_sse2(const int16_t *samples, size_t n,
+				int threshold)
+{
+	const __m128i hi = _mm_set1_epi16(threshold);
+	const __m128i lo = _mm_set1_epi16(-threshold);
+	size_t tail = n & 7;
+	size_t ret = last_audible_scalar(samples + n - tail, tail, threshold);
+	if (ret > 0)
+		return n - tail + ret;
+	n -= tail;
+	while (n > 0) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (samples + n - 8));
+		__m128i loud = _mm_or_si128(_mm_cmpgt_epi16(x, hi),
+					    _mm_cmplt_epi16(x, lo));
+		if (_mm_movemask_epi8(loud))
+			return n - 8 + last_audible_scalar(samples + n - 8, 8,
+							   threshold);
+		n -= 8;
+	}
+	return 0;
+}
+
+__attribute__((target("avx2")))
+static size_t last_audible_avx2(const int16_t *samples, size_t n,
+				int threshold)
+{
+	const __m256i hi = _mm256_set1_epi16(threshold);
+	const __m256i lo = _mm256_set1_epi16(-threshold);
+	size_t tail = n & 15;
+	size_t ret = last_audible_scalar(samples + n - tail, tail, threshold);
+	if (ret > 0)
+		return n - tail + ret;
+	n -= tail;
+	while (n > 0) {
+		__m256i x = _mm256_loadu_si256(
+			(const __m256i *) (samples + n - 16));
+		__m256i loud = _mm256_or_si256(_mm256_cmpgt_epi16(x, hi),
+					       _mm256_cmpgt_epi16(lo, x));
+		if (_mm256_movemask_epi8(loud))
+			return n - 16 + last_audible_scalar(samples + n - 16,
+							    16, threshold);
+		n -= 16;
+	}
+	return 0;
+}
+#endif
 
-	ret = iconv(iconv_cd, &in, &inbytesleft, &out, &outbytesleft);
-	if (ret == ((size_t) -1))
-		z_die("Characted encoding error: %s\n", strerror(errno));
+static size_t (*last_audible)(const int16_t *samples, size_t n,
+			      int threshold) = last_audible_scalar;
 
-	if (ben_dict_set_str_by_str(d, key, utf8))
-		z_die("Can not set %s to %s\n", utf8, key);
+/* Select the SIMD variants of the silence and ASCII scanners */
+static void init_simd(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		last_audible = last_audible_avx2;
+		ascii_prefix_len = ascii_prefix_len_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		last_audible = last_audible_sse2;
+		ascii_prefix_len = ascii_prefix_len_sse2;
+	}
+#endif
 }
 
 /* Simulate one subsong, and return the number of bytes simulated */
-static size_t simulate(struct uade_state *state)
+static size_t simulate(struct worker *worker)
 {
-	char buf[4096];
+	struct uade_state *state = worker->state;
+	int16_t buf[2048];
 	size_t nbytes = 0;
+	size_t bytespersecond = uade_get_sampling_rate(state) *
+		UADE_BYTES_PER_FRAME;
+	size_t silencebytes = silence_window * bytespersecond;
+	size_t audiblebytes = 0;
+	size_t simulatedbytes = 0;
+	size_t frames;
+	struct loop_detector *ld = NULL;
+	int trim = 0;
+
+	worker->subsong_estimated = 0;
+
+	if (loop_confirm_time > 0) {
+		ld = malloc(sizeof *ld);
+		if (ld == NULL)
+			z_die("No memory for loop detection\n");
+		loop_detector_init(ld, bytespersecond);
+	}
 
 	while (1) {
 		struct uade_notification n;
 		ssize_t ret = uade_read(buf, sizeof buf, state);
 		if (ret < 0) {
-			fprintf(stderr, "Playback error.\n");
+			fprintf(worker->log, "Playback error.\n");
 			nbytes = -1;
 			break;
 		} else if (ret == 0) {
+			trim = 1;
 			break;
 		}
 
+		if (silencebytes > 0) {
+			frames = last_audible(buf, ret / 2, silence_threshold) /
+				(UADE_BYTES_PER_FRAME / 2);
+			if (frames > 0)
+				audiblebytes = nbytes +
+					frames * UADE_BYTES_PER_FRAME;
+		}
+
 		nbytes += ret;
+		simulatedbytes += ret;
 
 		while (uade_read_notification(&n, state)) {
 			if (n.type == UADE_NOTIFICATION_SONG_END) {
@@ -110,12 +1034,64 @@ static size_t simulate(struct uade_state *state)
 				 */
 				nbytes = n.song_end.subsongbytes;
 				uade_cleanup_notification(&n);
-				return nbytes;
+				trim = 1;
+				goto out;
 			}
 			uade_cleanup_notification(&n);
 		}
+
+		if (ld != NULL && loop_detector_feed(ld, buf, ret)) {
+			/*
+			 * Without loop detection the subsong would have been
+			 * simulated until a timeout.
+			 */
+			double saved = subsong_timeout -
+				((double) nbytes) / bytespersecond;
+			if (saved < 0)
+				saved = 0;
+			fprintf(worker->log, "Loop detected at %.3fs "
+				"(period %.3fs). Saved up to %.1fs of "
+				"simulation.\n",
+				((double) ld->loopstart) / bytespersecond,
+				((double) ld->loopperiod) / bytespersecond,
+				saved);
+			worker->loop_saved_time += saved;
+			nbytes = ld->loopstart;
+			break;
+		}
+
+		/* Leading silence does not end the subsong */
+		if (silencebytes > 0 && audiblebytes > 0 &&
+		    (nbytes - audiblebytes) >= silencebytes) {
+			fprintf(worker->log, "Silence detected after %.3fs\n",
+				((double) audiblebytes) / bytespersecond);
+			trim = 1;
+			break;
+		}
+
+		if (worker->max_subsong_bytes > 0 &&
+		    nbytes >= worker->max_subsong_bytes) {
+			fprintf(worker->log, "Time budget exhausted after "
+				"%.3fs. The subsong length is an estimate.\n",
+				((double) nbytes) / bytespersecond);
+			worker->subsong_estimated = 1;
+			break;
+		}
 	}
 
+out:
+	/*
+	 * Trim the trailing silence from the subsong length, also when uade
+	 * ended the subsong. Loops and budget cuts are not trimmed.
+	 */
+	if (trim && silencebytes > 0 && audiblebytes > 0 &&
+	    audiblebytes < nbytes)
+		nbytes = audiblebytes;
+	worker->simulated_time += ((double) simulatedbytes) / bytespersecond;
+	if (ld != NULL) {
+		loop_detector_free(ld);
+		free(ld);
+	}
 	return nbytes;
 }
 
@@ -150,20 +1126,27 @@ struct bencode *create_container(void)
 	return list;
 }
 
-static void set_playtime(struct bencode *container, int sub, int playtime)
+static void set_playtime_value(struct bencode *container, int sub,
+			       int playtime)
 {
 	struct bencode *key = ben_int(sub);
 	struct bencode *value = ben_int(playtime);
 	struct bencode *meta = ben_list_get(container, 1);
 	struct bencode *subsongs = ben_dict_get_by_str(meta, "subsongs");
-	if (playtime == 0)
-		return;
 	if (key == NULL || value == NULL)
 		z_die("Can not allocate memory for key/value\n");
 	if (ben_dict_set(subsongs, key, value))
 		z_die("Can not insert %s -> %s to dictionary\n",
 		      ben_print(key), ben_print(value));
-	fprintf(stderr, "Subsong %d: %.3fs\n", sub, playtime / 1000.0);
+}
+
+static void set_playtime(struct worker *worker, struct bencode *container,
+			 int sub, int playtime)
+{
+	if (playtime == 0)
+		return;
+	set_playtime_value(container, sub, playtime);
+	fprintf(worker->log, "Subsong %d: %.3fs\n", sub, playtime / 1000.0);
 }
 
 static void print_dict_keys(FILE *f, const struct bencode *files,
@@ -185,42 +1168,6 @@ static void print_dict_keys(FILE *f, const struct bencode *files,
 	}
 }
 
-static int write_rmc(const char *targetfname, const struct bencode *container)
-{
-	char *data;
-	size_t len;
-	struct bencode *files = ben_list_get(container, 2);
-	FILE *f;
-	int ret = -1;
-	char *metastring = ben_print(ben_list_get(container, 1));
-
-	fprintf(stdout, "meta: %s files: ", metastring);
-	z_free_and_null(metastring);
-
-	print_dict_keys(stdout, files, "");
-	fprintf(stdout, "\n");
-
-	data = ben_encode(&len, container);
-	if (data == NULL)
-		z_die("Can not serialize\n");
-
-	f = fopen(targetfname, "wb");
-	if (f != NULL) {
-		if (xfwrite(data, 1, len, f) == len) {
-			ret = 0;
-		} else {
-			z_log_error("Can not write all data to %s\n", targetfname);
-			unlink(targetfname);
-		}
-		fclose(f);
-	} else {
-		z_log_error("Can not create file %s\n", targetfname);
-	}
-
-	free(data);
-	return ret;
-}
-
 static void xbasename(char *bname, size_t maxlen, const char *fname)
 {
 	char path[PATH_MAX];
@@ -235,7 +1182,253 @@ static void xdirname(char *dname, size_t maxlen, const char *fname)
 	snprintf(dname, maxlen, "%s", dirname(path));
 }
 
-static struct bencode *get_basename(const char *fname)
+static int stream_value(FILE *f, const struct bencode *b);
+
+static int compare_keys(const void *a, const void *b)
+{
+	const struct bencode * const *x = a;
+	const struct bencode * const *y = b;
+	return ben_cmp(*x, *y);
+}
+
+static int stream_str(FILE *f, const void *data, size_t len)
+{
+	if (fprintf(f, "%zu:", len) < 0)
+		return -1;
+	return xfwrite(data, 1, len, f) == len ? 0 : -1;
+}
+
+/* Dictionary keys are written in the same sorted order as ben_encode() */
+static int stream_dict(FILE *f, const struct bencode *d)
+{
+	size_t n = ben_dict_len(d);
+	struct bencode **keys = malloc((n + 1) * sizeof keys[0]);
+	struct bencode *key;
+	struct bencode *value;
+	size_t pos;
+	size_t i;
+	int ret = -1;
+
+	if (keys == NULL)
+		z_die("No memory for dictionary keys\n");
+
+	i = 0;
+	ben_dict_for_each(key, value, pos, d)
+		keys[i++] = key;
+	assert(i == n);
+	qsort(keys, n, sizeof keys[0], compare_keys);
+
+	if (fputc('d', f) == EOF)
+		goto out;
+	for (i = 0; i < n; i++) {
+		if (stream_value(f, keys[i]) ||
+		    stream_value(f, ben_dict_get(d, keys[i])))
+			goto out;
+	}
+	if (fputc('e', f) == EOF)
+		goto out;
+	ret = 0;
+out:
+	free(keys);
+	return ret;
+}
+
+/*
+ * Write bencode serialization of b to f without building the whole
+ * serialization in memory. Strings (file contents) are written directly
+ * from the bencode objects.
+ */
+static int stream_value(FILE *f, const struct bencode *b)
+{
+	struct bencode *item;
+	size_t pos;
+	size_t len;
+	char *data;
+	int ret;
+
+	if (ben_is_str(b))
+		return stream_str(f, ben_str_val(b), ben_str_len(b));
+
+	if (ben_is_dict(b))
+		return stream_dict(f, b);
+
+	if (ben_is_list(b)) {
+		if (fputc('l', f) == EOF)
+			return -1;
+		ben_list_for_each(item, pos, b) {
+			if (stream_value(f, item))
+				return -1;
+		}
+		return fputc('e', f) == EOF ? -1 : 0;
+	}
+
+	/* Integers and other small values */
+	data = ben_encode(&len, b);
+	if (data == NULL)
+		z_die("Can not serialize\n");
+	ret = xfwrite(data, 1, len, f) == len ? 0 : -1;
+	free(data);
+	return ret;
+}
+
+/*
+ * Create a temporary file in the same directory as fname. The temporary
+ * file is renamed over fname in finish_temp_file() so that readers never
+ * see a partially written file.
+ */
+static FILE *create_temp_file(char *tmpname, size_t maxlen, const char *fname)
+{
+	char dname[PATH_MAX];
+	char bname[PATH_MAX];
+	struct stat st;
+	mode_t mode = file_create_mode;
+	FILE *f;
+	int fd;
+	int ret;
+
+	xdirname(dname, sizeof dname, fname);
+	xbasename(bname, sizeof bname, fname);
+	ret = snprintf(tmpname, maxlen, "%s/.%s.XXXXXX", dname, bname);
+	z_assert(ret >= 0 && ((size_t) ret) < maxlen);
+
+	fd = mkstemp(tmpname);
+	if (fd < 0) {
+		z_log_error("Can not create temp file for %s (%s)\n",
+			    fname, strerror(errno));
+		return NULL;
+	}
+
+	/* Keep permissions of the file being replaced */
+	if (stat(fname, &st) == 0)
+		mode = st.st_mode & 07777;
+	if (fchmod(fd, mode))
+		z_log_warning("Can not set permissions of %s (%s)\n",
+			      tmpname, strerror(errno));
+
+	f = fdopen(fd, "wb");
+	if (f == NULL) {
+		z_log_error("Can not open temp file %s (%s)\n",
+			    tmpname, strerror(errno));
+		close(fd);
+		unlink(tmpname);
+	}
+	return f;
+}
+
+/*
+ * Close a temp file created by create_temp_file(). If ret is 0, the temp
+ * file is synced and renamed to fname. Otherwise it is removed. Returns 0
+ * on successful replacement of fname.
+ */
+static int finish_temp_file(FILE *f, const char *tmpname, const char *fname,
+			    int ret)
+{
+	if (ret == 0 && (fflush(f) || fsync(fileno(f)))) {
+		z_log_error("Can not write all data to %s (%s)\n",
+			    fname, strerror(errno));
+		ret = -1;
+	}
+	if (fclose(f) && ret == 0) {
+		z_log_error("Can not close %s (%s)\n", tmpname,
+			    strerror(errno));
+		ret = -1;
+	}
+	if (ret == 0 && rename(tmpname, fname)) {
+		z_log_error("Can not rename %s to %s (%s)\n",
+			    tmpname, fname, strerror(errno));
+		ret = -1;
+	}
+	if (ret != 0) {
+		unlink(tmpname);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Writes the files dictionary of a container whose files are not bencode
+ * objects in the container (repack and pack).
+ */
+struct files_writer {
+	int (*write)(FILE *f, const void *context);
+	void (*print_keys)(FILE *f, const void *context);
+	const void *context;
+};
+
+static int write_file_index(FILE *f, off_t start, off_t end);
+
+/*
+ * Write container into targetfname. If files is not NULL, it writes the
+ * files dictionary instead of the files of container. The file index is
+ * appended after the files dictionary unless --no-file-index is given.
+ * Encoding and writing times are added to stats, if it is not NULL.
+ */
+static int write_container(const char *targetfname,
+			   const struct bencode *container,
+			   const struct files_writer *files_writer,
+			   struct file_stats *stats)
+{
+	struct bencode *files = ben_list_get(container, 2);
+	char tmpname[PATH_MAX];
+	FILE *f;
+	off_t start;
+	int ret;
+	double t;
+	char *metastring = ben_print(ben_list_get(container, 1));
+
+	/* Keep the line whole when several workers are writing */
+	flockfile(stdout);
+	fprintf(stdout, "meta: %s files: ", metastring);
+	z_free_and_null(metastring);
+
+	if (files_writer == NULL)
+		print_dict_keys(stdout, files, "");
+	else
+		files_writer->print_keys(stdout, files_writer->context);
+	fprintf(stdout, "\n");
+	funlockfile(stdout);
+
+	f = create_temp_file(tmpname, sizeof tmpname, targetfname);
+	if (f == NULL) {
+		z_log_error("Can not create file %s\n", targetfname);
+		return -1;
+	}
+
+	t = gettime();
+	ret = (fputc('l', f) == EOF ||
+	       stream_value(f, ben_list_get(container, 0)) ||
+	       stream_value(f, ben_list_get(container, 1))) ? -1 : 0;
+	start = ftello(f);
+	if (ret == 0) {
+		if (files_writer == NULL)
+			ret = stream_value(f, files);
+		else
+			ret = files_writer->write(f, files_writer->context);
+	}
+	if (ret == 0 && use_file_index)
+		ret = write_file_index(f, start, ftello(f));
+	if (ret == 0 && fputc('e', f) == EOF)
+		ret = -1;
+	if (ret)
+		z_log_error("Can not write all data to %s\n", targetfname);
+	if (stats != NULL) {
+		stats->encode += gettime() - t;
+		t = gettime();
+	}
+
+	ret = finish_temp_file(f, tmpname, targetfname, ret);
+	if (stats != NULL)
+		stats->write += gettime() - t;
+	return ret;
+}
+
+static int write_rmc(const char *targetfname, const struct bencode *container,
+		     struct file_stats *stats)
+{
+	return write_container(targetfname, container, NULL, stats);
+}
+
+static struct bencode *get_basename(const char *fname)
 {
 	char path[PATH_MAX];
 	struct bencode *bname;
@@ -276,18 +1469,269 @@ static void set_info(struct bencode *meta, struct uade_state *state)
 	}
 }
 
+/*
+ * Set the content hash of a file in meta['file_hashes'], a dictionary from
+ * file paths to 128-bit MurmurHash3 in hex. Files that are shared by many
+ * containers, such as eagleplayers and instruments, have the same hash.
+ * Hashes are only recorded for the shared store (--store).
+ */
+static void record_file_hash(struct bencode *container, const char *relname,
+			     const void *data, size_t len)
+{
+	struct bencode *meta = ben_list_get(container, 1);
+	struct bencode *hashes = ben_dict_get_by_str(meta, "file_hashes");
+	struct rmc_hash hash;
+	char hex[33];
+
+	if (hashes == NULL) {
+		hashes = ben_dict();
+		if (hashes == NULL ||
+		    ben_dict_set_by_str(meta, "file_hashes", hashes))
+			z_die("Can not set file hashes\n");
+	}
+	rmc_hash(&hash, data, len, 0);
+	rmc_hash_to_hex(hex, &hash);
+	if (ben_dict_set_str_by_str(hashes, relname, hex))
+		z_die("Can not set file hash of %s\n", relname);
+}
+
 static void record_file(struct bencode *container, const char *relname,
 			void *data, size_t len,
 			struct collection_context *context, const char *fname)
 {
 	if (uade_rmc_record_file(container, relname, data, len))
 		z_die("Failed to record %s into container\n", fname);
+	if (store_dir != NULL)
+		record_file_hash(container, relname, data, len);
 	if (ben_list_append_str(context->filelist, fname))
 		z_die("Failed to append %s to file list\n", fname);
 }
 
-struct uade_file *collect_files(const char *amiganame, const char *playerdir,
-				void *context, struct uade_state *state)
+/*
+ * Process-wide LRU cache of files that eagleplayers load through
+ * collect_files(). The same eagleplayer auxiliary files and shared
+ * instruments are loaded for many songs. Entries are found by the
+ * requested Amiga name, and are valid while the resolved file has the same
+ * mtime and size. The total size of cached data is limited by
+ * file_cache_size (--file-cache).
+ */
+#define FILE_CACHE_BUCKETS 1024
+
+struct file_cache_entry {
+	char *key;
+	uint64_t hash;
+	struct uade_file *f;
+	struct timespec mtime;
+	off_t size;
+	struct file_cache_entry *hnext;
+	struct file_cache_entry *prev;
+	struct file_cache_entry *next;
+};
+
+struct file_cache {
+	pthread_mutex_t lock;
+	struct file_cache_entry *buckets[FILE_CACHE_BUCKETS];
+	/* Most recently used first */
+	struct file_cache_entry *head;
+	struct file_cache_entry *tail;
+	size_t bytes;
+	size_t nentries;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+static struct file_cache file_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void file_cache_unlink(struct file_cache_entry *e)
+{
+	if (e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		file_cache.head = e->next;
+	if (e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		file_cache.tail = e->prev;
+	e->prev = NULL;
+	e->next = NULL;
+}
+
+static void file_cache_push_front(struct file_cache_entry *e)
+{
+	e->next = file_cache.head;
+	if (file_cache.head != NULL)
+		file_cache.head->prev = e;
+	file_cache.head = e;
+	if (file_cache.tail == NULL)
+		file_cache.tail = e;
+}
+
+static void file_cache_remove(struct file_cache_entry *e)
+{
+	struct file_cache_entry **p = &file_cache.buckets[
+		e->hash % FILE_CACHE_BUCKETS];
+	while (*p != e)
+		p = &(*p)->hnext;
+	*p = e->hnext;
+	file_cache_unlink(e);
+	file_cache.bytes -= e->f->size;
+	file_cache.nentries--;
+	uade_file_free(e->f);
+	free(e->key);
+	free(e);
+}
+
+static int file_cache_valid(const char *name, off_t size,
+			    const struct timespec *mtime)
+{
+	struct stat st;
+	return stat(name, &st) == 0 && st.st_size == size &&
+		st.st_mtim.tv_sec == mtime->tv_sec &&
+		st.st_mtim.tv_nsec == mtime->tv_nsec;
+}
+
+/* Called with file_cache.lock held */
+static struct file_cache_entry *file_cache_find(const char *key,
+						uint64_t hash)
+{
+	struct file_cache_entry *e;
+	for (e = file_cache.buckets[hash % FILE_CACHE_BUCKETS]; e != NULL;
+	     e = e->hnext) {
+		if (e->hash == hash && strcmp(e->key, key) == 0)
+			break;
+	}
+	return e;
+}
+
+/*
+ * Returns a copy of the cached file, or NULL if the file is not cached.
+ * The file is revalidated with stat() outside of the lock, so that workers
+ * do not wait for each other's file system calls.
+ */
+static struct uade_file *file_cache_get(const char *key, uint64_t hash)
+{
+	struct file_cache_entry *e;
+	struct uade_file *f;
+	struct timespec mtime;
+	off_t size;
+	int valid;
+
+	pthread_mutex_lock(&file_cache.lock);
+	e = file_cache_find(key, hash);
+	if (e == NULL) {
+		file_cache.misses++;
+		pthread_mutex_unlock(&file_cache.lock);
+		return NULL;
+	}
+	f = uade_file(e->f->name, e->f->data, e->f->size);
+	if (f == NULL)
+		z_die("No memory for cached file %s\n", e->f->name);
+	mtime = e->mtime;
+	size = e->size;
+	pthread_mutex_unlock(&file_cache.lock);
+
+	valid = file_cache_valid(f->name, size, &mtime);
+
+	pthread_mutex_lock(&file_cache.lock);
+	/* The entry may have been replaced or evicted meanwhile */
+	e = file_cache_find(key, hash);
+	if (valid) {
+		if (e != NULL) {
+			file_cache_unlink(e);
+			file_cache_push_front(e);
+		}
+		file_cache.hits++;
+	} else {
+		if (e != NULL && e->size == size &&
+		    e->mtime.tv_sec == mtime.tv_sec &&
+		    e->mtime.tv_nsec == mtime.tv_nsec)
+			file_cache_remove(e);
+		file_cache.misses++;
+	}
+	pthread_mutex_unlock(&file_cache.lock);
+
+	if (!valid) {
+		uade_file_free(f);
+		return NULL;
+	}
+	return f;
+}
+
+static void file_cache_put(const char *key, uint64_t hash,
+			   const struct uade_file *f)
+{
+	struct file_cache_entry *e;
+	struct stat st;
+
+	/* Files without a real path, such as ENV:Foo, are not cached */
+	if (f->size > file_cache_size / 8 || stat(f->name, &st) ||
+	    !S_ISREG(st.st_mode) || (size_t) st.st_size != f->size)
+		return;
+
+	e = calloc(1, sizeof *e);
+	if (e == NULL)
+		z_die("No memory for file cache entry\n");
+	*e = (struct file_cache_entry) {.key = strdup(key), .hash = hash,
+					.f = uade_file(f->name, f->data,
+						       f->size),
+					.mtime = st.st_mtim,
+					.size = st.st_size};
+	if (e->key == NULL || e->f == NULL)
+		z_die("No memory for file cache entry\n");
+
+	pthread_mutex_lock(&file_cache.lock);
+	e->hnext = file_cache.buckets[hash % FILE_CACHE_BUCKETS];
+	file_cache.buckets[hash % FILE_CACHE_BUCKETS] = e;
+	file_cache_push_front(e);
+	file_cache.bytes += f->size;
+	file_cache.nentries++;
+	/* A duplicate from a concurrent miss is shadowed until it ages out */
+	while (file_cache.bytes > file_cache_size)
+		file_cache_remove(file_cache.tail);
+	pthread_mutex_unlock(&file_cache.lock);
+}
+
+static struct uade_file *load_amiga_file(const char *amiganame,
+					 const char *playerdir,
+					 struct uade_state *state)
+{
+	char key[2 * PATH_MAX];
+	struct rmc_hash hash;
+	struct uade_file *f;
+	int len;
+
+	if (file_cache_size == 0)
+		return uade_load_amiga_file(amiganame, playerdir, state);
+
+	len = snprintf(key, sizeof key, "%s\n%s", amiganame,
+		       playerdir != NULL ? playerdir : "");
+	if (len < 0 || ((size_t) len) >= sizeof key)
+		return uade_load_amiga_file(amiganame, playerdir, state);
+	rmc_hash(&hash, key, len, 0);
+
+	f = file_cache_get(key, hash.h[0]);
+	if (f != NULL)
+		return f;
+	f = uade_load_amiga_file(amiganame, playerdir, state);
+	if (f != NULL)
+		file_cache_put(key, hash.h[0], f);
+	return f;
+}
+
+static void print_file_cache_stats(void)
+{
+	unsigned long lookups = file_cache.hits + file_cache.misses;
+	if (lookups == 0)
+		return;
+	fprintf(stderr, "File cache: %lu hits, %lu misses (%.1f%% hit rate), "
+		"%zu files, %zu bytes cached\n", file_cache.hits,
+		file_cache.misses, 100.0 * file_cache.hits / lookups,
+		file_cache.nentries, file_cache.bytes);
+}
+
+static struct uade_file *collect_file(const char *amiganame,
+				      const char *playerdir, void *context,
+				      struct uade_state *state)
 {
 	char dirname[PATH_MAX];
 	char path[PATH_MAX];
@@ -297,7 +1741,7 @@ struct uade_file *collect_files(const char *amiganame, const char *playerdir,
 	struct collection_context *collection_context = context;
 	struct bencode *container = collection_context->container;
 	struct uade_file *oldfile;
-	struct uade_file *f = uade_load_amiga_file(amiganame, playerdir, state);
+	struct uade_file *f = load_amiga_file(amiganame, playerdir, state);
 	const char *name;
 
 	if (f == NULL)
@@ -340,7 +1784,7 @@ struct uade_file *collect_files(const char *amiganame, const char *playerdir,
 		return f;
 	}
 
-	fprintf(stderr, "Collecting %s\n", name);
+	fprintf(collection_context->worker->log, "Collecting %s\n", name);
 
 	record_file(container, path, f->data, f->size,
 		    collection_context, name);
@@ -348,20 +1792,31 @@ struct uade_file *collect_files(const char *amiganame, const char *playerdir,
 	return f;
 }
 
-static void get_targetname(char *name, size_t maxlen, struct uade_state *state)
+struct uade_file *collect_files(const char *amiganame, const char *playerdir,
+				void *context, struct uade_state *state)
+{
+	struct collection_context *collection_context = context;
+	double t = gettime();
+	struct uade_file *f = collect_file(amiganame, playerdir, context,
+					   state);
+	collection_context->worker->stats.collect += gettime() - t;
+	return f;
+}
+
+/* Get the .rmc name for a song file whose detected format extension is ext */
+static void get_targetname_by_ext(char *name, size_t maxlen,
+				  const char *modulefname, const char *ext)
 {
 	char dname[PATH_MAX];
 	char bname[PATH_MAX];
 	char newbname[PATH_MAX];
-	const struct uade_song_info *info = uade_get_song_info(state);
-	const char *ext = info->detectioninfo.ext;
 	int isprefix = 0;
 	int ispostfix = 0;
 	char *t = NULL;
 	int ret;
 
-	xdirname(dname, sizeof dname, info->modulefname);
-	xbasename(bname, sizeof bname, info->modulefname);
+	xdirname(dname, sizeof dname, modulefname);
+	xbasename(bname, sizeof bname, modulefname);
 
 	if (ext[0]) {
 		const size_t extlen = strlen(ext);
@@ -389,6 +1844,13 @@ static void get_targetname(char *name, size_t maxlen, struct uade_state *state)
 	z_assert(ret >= 0 && ((size_t) ret) < maxlen);
 }
 
+static void get_targetname(char *name, size_t maxlen, struct uade_state *state)
+{
+	const struct uade_song_info *info = uade_get_song_info(state);
+	get_targetname_by_ext(name, maxlen, info->modulefname,
+			      info->detectioninfo.ext);
+}
+
 static void meta_set_song(struct bencode *container, struct uade_file *f)
 {
 	struct bencode *meta = ben_list_get(container, 1);
@@ -401,12 +1863,321 @@ static void meta_set_song(struct bencode *container, struct uade_file *f)
 		z_die("Can not set song name to be played\n");
 }
 
+/* MD5 (RFC 1321) of songs, for looking up songs in the Modland md5 list */
+static const uint32_t md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+	0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+	0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+	0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+	0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+	0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_r[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_block(uint32_t h[4], const uint8_t *block)
+{
+	uint32_t w[16];
+	uint32_t a = h[0];
+	uint32_t b = h[1];
+	uint32_t c = h[2];
+	uint32_t d = h[3];
+	uint32_t f;
+	uint32_t t;
+	int g;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = load_le32(block + 4 * i);
+	for (i = 0; i < 64; i++) {
+		if (i < 16) {
+			f = (b & c) | (~b & d);
+			g = i;
+		} else if (i < 32) {
+			f = (d & b) | (~d & c);
+			g = (5 * i + 1) & 15;
+		} else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3 * i + 5) & 15;
+		} else {
+			f = c ^ (b | ~d);
+			g = (7 * i) & 15;
+		}
+		t = a + f + md5_k[i] + w[g];
+		a = d;
+		d = c;
+		c = b;
+		b += (t << md5_r[i]) | (t >> (32 - md5_r[i]));
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+}
+
+/* hex must have room for 33 bytes */
+static void md5_hex(char *hex, const void *data, size_t len)
+{
+	uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+	const uint8_t *p = data;
+	uint8_t tail[128];
+	uint8_t digest[16];
+	size_t left = len & 63;
+	size_t taillen = left < 56 ? 64 : 128;
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64)
+		md5_block(h, p + i);
+	memset(tail, 0, sizeof tail);
+	if (left > 0)
+		memcpy(tail, p + len - left, left);
+	tail[left] = 0x80;
+	put_le64(tail + taillen - 8, (uint64_t) len * 8);
+	for (i = 0; i < taillen; i += 64)
+		md5_block(h, tail + i);
+
+	for (i = 0; i < 4; i++)
+		put_le32(digest + 4 * i, h[i]);
+	for (i = 0; i < 16; i++)
+		snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+}
+
+/*
+ * Modland md5 list (--modland). Each line of allmods_md5.txt has the md5
+ * of a song and its path in Modland: "md5 format/author/.../song". The
+ * list is mapped, and a hash table of line offsets is built once, so that
+ * the authors of a song are found during conversion without a separate
+ * pass over the containers.
+ */
+#define MODLAND_MD5_LEN 32
+
+struct modland {
+	void *map;
+	size_t mapsize;
+	/* Line offset + 1 for each slot, or 0 if the slot is empty */
+	uint32_t *slots;
+	size_t mask;
+};
+
+static struct modland modland;
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/* The md5 is uniformly distributed, so its first bits are the hash */
+static size_t modland_slot(const char *md5)
+{
+	size_t key = 0;
+	size_t i;
+	for (i = 0; i < 2 * sizeof key; i++)
+		key = (key << 4) | hex_value(md5[i]);
+	return key & modland.mask;
+}
+
+static int modland_is_valid_line(const char *line, size_t len)
+{
+	size_t i;
+	if (len <= MODLAND_MD5_LEN + 1 || line[MODLAND_MD5_LEN] != ' ')
+		return 0;
+	for (i = 0; i < MODLAND_MD5_LEN; i++) {
+		if (hex_value(line[i]) < 0)
+			return 0;
+	}
+	return 1;
+}
+
+static int modland_open(const char *fname)
+{
+	const char *data;
+	const char *line;
+	const char *end;
+	size_t nlines = 0;
+	size_t nslots = 16;
+	size_t invalid = 0;
+	size_t slot;
+	struct stat st;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		z_log_error("Can not open file %s (%s)\n", fname,
+			    strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		z_log_error("Can not stat %s (%s)\n", fname, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (st.st_size == 0 || st.st_size >= UINT32_MAX) {
+		z_log_error("Invalid size of md5 list %s\n", fname);
+		close(fd);
+		return -1;
+	}
+	modland.mapsize = st.st_size;
+	modland.map = mmap(NULL, modland.mapsize, PROT_READ, MAP_SHARED, fd,
+			   0);
+	close(fd);
+	if (modland.map == MAP_FAILED) {
+		modland.map = NULL;
+		z_log_error("Can not map %s (%s)\n", fname, strerror(errno));
+		return -1;
+	}
+	data = modland.map;
+
+	for (line = data; line < data + modland.mapsize; line = end + 1) {
+		end = memchr(line, '\n', data + modland.mapsize - line);
+		if (end == NULL)
+			end = data + modland.mapsize;
+		nlines++;
+	}
+	/* Keep the table at most half full */
+	while (nslots < 2 * nlines)
+		nslots *= 2;
+	modland.slots = calloc(nslots, sizeof modland.slots[0]);
+	if (modland.slots == NULL)
+		z_die("No memory for md5 list\n");
+	modland.mask = nslots - 1;
+
+	for (line = data; line < data + modland.mapsize; line = end + 1) {
+		end = memchr(line, '\n', data + modland.mapsize - line);
+		if (end == NULL)
+			end = data + modland.mapsize;
+		if (!modland_is_valid_line(line, end - line)) {
+			if (end > line)
+				invalid++;
+			continue;
+		}
+		/* A later line with the same md5 replaces the earlier one */
+		for (slot = modland_slot(line); modland.slots[slot];
+		     slot = (slot + 1) & modland.mask) {
+			if (memcmp(data + modland.slots[slot] - 1, line,
+				   MODLAND_MD5_LEN) == 0)
+				break;
+		}
+		modland.slots[slot] = line - data + 1;
+	}
+	if (invalid > 0)
+		z_log_warning("Ignoring %zu invalid lines in %s\n", invalid,
+			      fname);
+	return 0;
+}
+
+/*
+ * Find the Modland path of a song by its md5 in hex. Returns NULL if the
+ * song is not in the list.
+ */
+static const char *modland_find(size_t *len, const char *md5)
+{
+	const char *data = modland.map;
+	const char *line;
+	const char *end;
+	size_t slot;
+
+	for (slot = modland_slot(md5); modland.slots[slot];
+	     slot = (slot + 1) & modland.mask) {
+		line = data + modland.slots[slot] - 1;
+		if (memcmp(line, md5, MODLAND_MD5_LEN) != 0)
+			continue;
+		line += MODLAND_MD5_LEN + 1;
+		end = memchr(line, '\n', data + modland.mapsize - line);
+		if (end == NULL)
+			end = data + modland.mapsize;
+		while (end > line && isspace((unsigned char) end[-1]))
+			end--;
+		*len = end - line;
+		return line;
+	}
+	return NULL;
+}
+
+/*
+ * Fill meta['authors'] from the Modland path of the song, if meta has no
+ * authors. The path is "format/author/.../song". '- unknown' is skipped
+ * and 'coop-' prefixes are removed.
+ */
+static void meta_set_modland_authors(struct bencode *container,
+				     struct uade_file *f)
+{
+	struct bencode *meta = ben_list_get(container, 1);
+	struct bencode *authors;
+	char md5[MODLAND_MD5_LEN + 1];
+	const char *path;
+	const char *field;
+	const char *author;
+	const char *next;
+	const char *end;
+	size_t len;
+
+	if (modland.map == NULL ||
+	    ben_dict_get_by_str(meta, "authors") != NULL)
+		return;
+	md5_hex(md5, f->data, f->size);
+	path = modland_find(&len, md5);
+	if (path == NULL)
+		return;
+
+	authors = ben_list();
+	if (authors == NULL)
+		z_die("No memory for authors\n");
+	end = path + len;
+	field = memchr(path, '/', len);
+	/* The format is the first field and the song is the last one */
+	while (field != NULL) {
+		field++;
+		next = memchr(field, '/', end - field);
+		if (next == NULL)
+			break;
+		author = field;
+		len = next - field;
+		field = next;
+		if (len == 9 && memcmp(author, "- unknown", 9) == 0)
+			continue;
+		if (len >= 5 && memcmp(author, "coop-", 5) == 0) {
+			author += 5;
+			len -= 5;
+			if (len == 7 && memcmp(author, "Unknown", 7) == 0)
+				continue;
+		}
+		if (ben_list_append(authors, ben_blob(author, len)))
+			z_die("No memory for authors\n");
+	}
+	if (ben_list_len(authors) == 0) {
+		ben_free(authors);
+		return;
+	}
+	if (ben_dict_set_by_str(meta, "authors", authors))
+		z_die("Can not set authors\n");
+}
+
 static void init_collection_context(struct collection_context *context,
 				    struct bencode *container,
-				    struct uade_file *f)
+				    struct uade_file *f, struct worker *worker)
 {
 	char fbasename[PATH_MAX];
-	*context = (struct collection_context) {.container = container};
+	*context = (struct collection_context) {.container = container,
+						.worker = worker};
 	xbasename(fbasename, sizeof fbasename, f->name);
 	context->filelist = ben_list();
 	if (context->filelist == NULL)
@@ -428,533 +2199,4751 @@ static int remove_collected_files(struct collection_context *context)
 				fname, strerror(errno));
 			ret = -1;
 		} else {
-			fprintf(stderr, "Removed %s\n", fname);
+			fprintf(context->worker->log, "Removed %s\n", fname);
 		}
 	}
 	return ret;
 }
 
-static int convert(struct uade_file *f, struct uade_state *state)
+/*
+ * Conversion result cache (-c dir). Results are addressed by a hash of the
+ * song contents and the settings that affect simulation, so moved, renamed
+ * and duplicated songs are converted without emulation. A cache entry is a
+ * bencoded dictionary:
+ *
+ *   {'ext': detected format extension,
+ *    'files': [collected file paths relative to the song, song excluded],
+ *    'meta': meta dictionary}
+ */
+static void get_cache_key(struct rmc_hash *key, const struct uade_file *f)
 {
-	const struct uade_song_info *info = uade_get_song_info(state);
-	int min = info->subsongs.min;
-	int max = info->subsongs.max;
-	int cur;
-	int ret = 0;
-	size_t subsongbytes;
-	long long starttime;
-	long long simtime;
-	int playtime;
-	int sumtime = 0;
-	int nsubsongs = max - min + 1;
-	struct bencode *container = NULL;
-	struct bencode *meta;
-	char targetname[PATH_MAX];
-	struct collection_context collection_context = {.filelist = NULL};
+	char settings[256];
+	struct rmc_hash seed;
+	int ret = snprintf(settings, sizeof settings,
+			   "rmc cache %d frequency %d subsong_timeout %d "
+			   "silence_timeout %d loop_confirm_time %d "
+			   "silence_window %.3f silence_threshold %d "
+			   "file_budget %.3f switch_subsongs %d",
+			   CACHE_VERSION, FREQUENCY, subsong_timeout,
+			   SILENCE_TIMEOUT, loop_confirm_time,
+			   silence_window, silence_threshold, file_budget,
+			   switch_subsongs);
+	z_assert(ret >= 0 && ((size_t) ret) < sizeof(settings));
+	rmc_hash(&seed, settings, strlen(settings), 0);
+	rmc_hash(key, f->data, f->size, seed.h[0] ^ seed.h[1]);
+}
+
+/* Get path of the cache entry. Creates the fan-out directory if mkdirs. */
+static void get_cache_path(char *path, size_t maxlen,
+			   const struct rmc_hash *key, int mkdirs)
+{
+	char hex[33];
+	int ret;
+
+	rmc_hash_to_hex(hex, key);
+	ret = snprintf(path, maxlen, "%s/%.2s", cache_dir, hex);
+	z_assert(ret >= 0 && ((size_t) ret) < maxlen);
+	if (mkdirs && mkdir(path, 0777) && errno != EEXIST)
+		z_log_warning("Can not create cache directory %s (%s)\n",
+			      path, strerror(errno));
+	ret = snprintf(path, maxlen, "%s/%.2s/%s", cache_dir, hex, hex + 2);
+	z_assert(ret >= 0 && ((size_t) ret) < maxlen);
+}
+
+static struct bencode *cache_lookup(const struct rmc_hash *key)
+{
+	char path[PATH_MAX];
+	struct bencode *entry;
+	void *data;
+	size_t size;
+
+	get_cache_path(path, sizeof path, key, 0);
+	data = z_file_read(&size, path);
+	if (data == NULL)
+		return NULL;
+	entry = ben_decode(data, size);
+	free(data);
+	if (entry == NULL || !ben_is_dict(entry) ||
+	    !ben_is_str(ben_dict_get_by_str(entry, "ext")) ||
+	    !ben_is_list(ben_dict_get_by_str(entry, "files")) ||
+	    !ben_is_dict(ben_dict_get_by_str(entry, "meta"))) {
+		z_log_warning("Ignoring invalid cache entry %s\n", path);
+		ben_free(entry);
+		return NULL;
+	}
+	return entry;
+}
+
+static void list_file_paths(struct bencode *list, const struct bencode *files,
+			    const char *oldprefix)
+{
+	size_t pos;
+	struct bencode *key;
+	struct bencode *value;
+	char prefix[PATH_MAX];
+
+	ben_dict_for_each(key, value, pos, files) {
+		if (ben_is_dict(value)) {
+			snprintf(prefix, sizeof prefix, "%s%s/", oldprefix,
+				 ben_str_val(key));
+			list_file_paths(list, value, prefix);
+			continue;
+		}
+		snprintf(prefix, sizeof prefix, "%s%s", oldprefix,
+			 ben_str_val(key));
+		if (ben_list_append_str(list, prefix)) {
+			z_die("Can not append %s to file list\n", prefix);
+		}
+	}
+}
+
+/*
+ * Create a cache entry of a converted container. It is created before
+ * meta is filled by options that are not part of the cache key, such as
+ * --modland, so that a cache hit gets them from the options of its run.
+ */
+static struct bencode *cache_entry_create(const struct bencode *container,
+					  struct uade_file *f,
+					  const char *ext)
+{
+	char songname[PATH_MAX];
+	struct bencode *entry = ben_dict();
+	struct bencode *files = ben_list();
+	struct bencode *relnames = ben_list();
+	struct bencode *meta;
+	struct bencode *str;
+	size_t pos;
+
+	if (entry == NULL || files == NULL || relnames == NULL)
+		z_die("No memory for cache entry\n");
+
+	xbasename(songname, sizeof songname, f->name);
+	list_file_paths(relnames, ben_list_get(container, 2), "");
+	ben_list_for_each(str, pos, relnames) {
+		if (strcmp(ben_str_val(str), songname) == 0)
+			continue;
+		if (ben_list_append(files, ben_clone(str)))
+			z_die("Can not append to cache file list\n");
+	}
+	ben_free(relnames);
+
+	meta = ben_clone(ben_list_get(container, 1));
+	if (meta == NULL)
+		z_die("No memory for cache entry\n");
+	/* Hashes depend on --store, and are recorded again on a hit */
+	ben_free(ben_dict_pop_by_str(meta, "file_hashes"));
+	if (ben_dict_set_str_by_str(entry, "ext", ext) ||
+	    ben_dict_set_by_str(entry, "files", files) ||
+	    ben_dict_set_by_str(entry, "meta", meta))
+		z_die("Can not create cache entry\n");
+	return entry;
+}
+
+static void cache_store(const struct rmc_hash *key,
+			const struct bencode *entry)
+{
+	char path[PATH_MAX];
+	char tmpname[PATH_MAX];
+	FILE *tmpf;
+
+	get_cache_path(path, sizeof path, key, 1);
+	tmpf = create_temp_file(tmpname, sizeof tmpname, path);
+	if (tmpf != NULL)
+		finish_temp_file(tmpf, tmpname, path, stream_value(tmpf, entry));
+}
+
+/*
+ * Shared store of files (--store). Files other than the song are moved
+ * out of converted containers into the store, named by their content
+ * hash, so that each shared file is stored only once. The container lists
+ * them in meta['stored_files'], and the hashes are in meta['file_hashes'].
+ * Unpacking with the same store restores a normal files dictionary.
+ */
+static int is_hash_hex(const char *hex)
+{
+	return strlen(hex) == 32 && strspn(hex, "0123456789abcdef") == 32;
+}
+
+static void get_store_path(char *path, size_t maxlen, const char *hex,
+			   int mkdirs)
+{
+	int ret = snprintf(path, maxlen, "%s/%.2s", store_dir, hex);
+	z_assert(ret >= 0 && ((size_t) ret) < maxlen);
+	if (mkdirs && mkdir(path, 0777) && errno != EEXIST)
+		z_log_warning("Can not create store directory %s (%s)\n",
+			      path, strerror(errno));
+	ret = snprintf(path, maxlen, "%s/%.2s/%s", store_dir, hex, hex + 2);
+	z_assert(ret >= 0 && ((size_t) ret) < maxlen);
+}
+
+static int store_blob(const char *hex, const void *data, size_t len)
+{
+	char path[PATH_MAX];
+	char tmpname[PATH_MAX];
 	struct stat st;
+	FILE *f;
+	int ret;
 
-	assert(nsubsongs > 0);
+	get_store_path(path, sizeof path, hex, 1);
+	if (stat(path, &st) == 0) {
+		if ((size_t) st.st_size == len)
+			return 0;
+		z_log_error("%s in the store has a different size\n", path);
+		return -1;
+	}
+	f = create_temp_file(tmpname, sizeof tmpname, path);
+	if (f == NULL)
+		return -1;
+	ret = xfwrite(data, 1, len, f) == len ? 0 : -1;
+	return finish_temp_file(f, tmpname, path, ret);
+}
 
-	get_targetname(targetname, sizeof targetname, state);
+/*
+ * Get the file at path from the files dictionary, and remove it if pop is
+ * set. Directories that become empty are removed.
+ */
+static struct bencode *get_file_value(struct bencode *files, const char *path,
+				      int pop)
+{
+	char name[PATH_MAX];
+	const char *slash = strchr(path, '/');
+	struct bencode *value;
+	struct bencode *dir;
+	size_t len;
 
-	if (stat(targetname, &st) == 0 &&
-	    overwrite_mode == 0) {
-		fprintf(stderr,
-			"Not overwriting file %s. Not converting file %s.\n",
-			targetname, f->name);
-		goto exit;
+	if (slash == NULL) {
+		value = ben_dict_get_by_str(files, path);
+		if (value == NULL || !ben_is_str(value))
+			return NULL;
+		return pop ? ben_dict_pop_by_str(files, path) : value;
 	}
-	fprintf(stderr, "Converting %s to %s (%d subsongs)\n",
-	      f->name, targetname, nsubsongs);
+	len = slash - path;
+	if (len >= sizeof name)
+		return NULL;
+	memcpy(name, path, len);
+	name[len] = 0;
+	dir = ben_dict_get_by_str(files, name);
+	if (dir == NULL || !ben_is_dict(dir))
+		return NULL;
+	value = get_file_value(dir, slash + 1, pop);
+	if (pop && value != NULL && ben_dict_len(dir) == 0)
+		ben_free(ben_dict_pop_by_str(files, name));
+	return value;
+}
 
-	container = create_container();
-	meta = ben_list_get(container, 1);
+static void store_shared_files(struct bencode *container)
+{
+	struct bencode *meta = ben_list_get(container, 1);
+	struct bencode *files = ben_list_get(container, 2);
+	struct bencode *hashes = ben_dict_get_by_str(meta, "file_hashes");
+	struct bencode *song = ben_dict_get_by_str(meta, "song");
+	struct bencode *stored;
+	struct bencode *key;
+	struct bencode *hash;
+	struct bencode *value;
+	size_t pos;
 
-	uade_stop(state);
+	/* Only files moved by this run are listed */
+	ben_free(ben_dict_pop_by_str(meta, "stored_files"));
+	if (store_dir == NULL || hashes == NULL || !ben_is_dict(hashes))
+		return;
 
-	init_collection_context(&collection_context, container, f);
+	stored = ben_list();
+	if (stored == NULL)
+		z_die("No memory for stored files\n");
+	ben_dict_for_each(key, hash, pos, hashes) {
+		if (!ben_is_str(key) || !ben_is_str(hash) ||
+		    !is_hash_hex(ben_str_val(hash)))
+			continue;
+		if (song != NULL && ben_cmp(key, song) == 0)
+			continue;
+		value = get_file_value(files, ben_str_val(key), 0);
+		if (value == NULL)
+			continue;
+		/* The file is kept in the container if it can not be stored */
+		if (store_blob(ben_str_val(hash), ben_str_val(value),
+			       ben_str_len(value)))
+			continue;
+		ben_free(get_file_value(files, ben_str_val(key), 1));
+		if (ben_list_append(stored, ben_clone(key)))
+			z_die("No memory for stored files\n");
+	}
+	if (ben_list_len(stored) == 0) {
+		ben_free(stored);
+		return;
+	}
+	if (ben_dict_set_by_str(meta, "stored_files", stored))
+		z_die("Can not set stored files\n");
+}
 
-	uade_set_amiga_loader(collect_files, &collection_context, state);
+/*
+ * Read a file of the container from the store, and check its hash.
+ * Returns NULL if the file is not in meta['stored_files'] or the store.
+ */
+static void *read_stored_file(size_t *size, const struct bencode *meta,
+			      const char *relname)
+{
+	struct bencode *stored = ben_dict_get_by_str(meta, "stored_files");
+	struct bencode *hashes = ben_dict_get_by_str(meta, "file_hashes");
+	struct bencode *hash;
+	struct bencode *str;
+	struct rmc_hash check;
+	char path[PATH_MAX];
+	char hex[33];
+	size_t pos;
+	void *data;
+	int found = 0;
 
-	starttime = getmstime();
+	if (stored == NULL || !ben_is_list(stored) || hashes == NULL ||
+	    !ben_is_dict(hashes))
+		return NULL;
+	ben_list_for_each(str, pos, stored) {
+		if (ben_is_str(str) && strcmp(ben_str_val(str), relname) == 0)
+			found = 1;
+	}
+	hash = ben_dict_get_by_str(hashes, relname);
+	if (!found || hash == NULL || !ben_is_str(hash) ||
+	    !is_hash_hex(ben_str_val(hash)))
+		return NULL;
 
-	for (cur = min; cur <= max; cur++) {
-		int bytespersecond = uade_get_sampling_rate(state) *
-			UADE_BYTES_PER_FRAME;
+	get_store_path(path, sizeof path, ben_str_val(hash), 0);
+	data = z_file_read(size, path);
+	if (data == NULL) {
+		z_log_error("Can not read %s from the store: %s\n", relname,
+			    path);
+		return NULL;
+	}
+	rmc_hash(&check, data, *size, 0);
+	rmc_hash_to_hex(hex, &check);
+	if (strcmp(hex, ben_str_val(hash)) != 0) {
+		z_log_error("%s in the store is corrupted\n", path);
+		free(data);
+		return NULL;
+	}
+	return data;
+}
 
-		if (nsubsongs > 1)
-			fprintf(stderr, "Converting subsong %d / %d\n",
-				cur, max);
+/*
+ * Create the container from a cache entry without emulation. Collected files
+ * are read from the directory of the song. Returns 0 on success, -1 on
+ * failure, and 1 if the cache entry can not be used for this song.
+ */
+static int convert_cached(struct uade_file *f, struct worker *worker,
+			  const struct bencode *entry)
+{
+	const char *ext = ben_str_val(ben_dict_get_by_str(entry, "ext"));
+	const struct bencode *relnames = ben_dict_get_by_str(entry, "files");
+	char dname[PATH_MAX];
+	char targetname[PATH_MAX];
+	char path[PATH_MAX];
+	struct collection_context collection_context = {.filelist = NULL};
+	struct bencode *container = NULL;
+	struct bencode *str;
+	struct uade_file *aux;
+	struct stat st;
+	size_t pos;
+	int ret = 0;
 
-		ret = uade_play_from_buffer(f->name, f->data, f->size, cur,
-					    state);
-		if (ret < 0) {
-			uade_cleanup_state(state);
-			z_log_warning("Error in uade state when initializing "
-				      "%s\n", f->name);
-			goto error;
-		} else if (ret == 0) {
-			fprintf(stderr, "%s is not playable\n", f->name);
-			goto error;
-		}
+	get_targetname_by_ext(targetname, sizeof targetname, f->name, ext);
 
-		set_info(meta, state);
+	if (stat(targetname, &st) == 0 && overwrite_mode == 0) {
+		fprintf(worker->log,
+			"Not overwriting file %s. Not converting file %s.\n",
+			targetname, f->name);
+		return 0;
+	}
 
-		subsongbytes = simulate(state);
-		if (subsongbytes == ((size_t) -1))
-			goto error;
+	container = create_container();
+	if (ben_list_set(container, 1,
+			 ben_clone(ben_dict_get_by_str(entry, "meta"))))
+		z_die("Can not set meta from cache\n");
 
-		playtime = (subsongbytes * 1000) / bytespersecond;
-		assert(cur <= max);
-		set_playtime(container, cur, playtime);
-		sumtime += playtime;
+	init_collection_context(&collection_context, container, f, worker);
 
-		uade_stop(state);
+	/* Collected file paths are relative to the directory of the song */
+	if (strchr(f->name, '/')) {
+		xdirname(path, sizeof path, f->name);
+		z_snprintf_or_die(dname, sizeof(dname), "%s/", path);
+	} else {
+		dname[0] = 0;
 	}
 
-	simtime = getmstime() - starttime;
-	if (simtime < 0)
-		simtime = 0;
-	fprintf(stderr, "play time %d ms, simulation time %lld ms, "
-		"speedup %.1fx\n",
-		sumtime, simtime, ((float) sumtime) / simtime);
+	ben_list_for_each(str, pos, relnames) {
+		if (!ben_is_str(str) || strstr(ben_str_val(str), "..")) {
+			ret = 1;
+			goto out;
+		}
+		z_snprintf_or_die(path, sizeof(path), "%s%s", dname,
+				  ben_str_val(str));
+		aux = uade_file_load(path);
+		if (aux == NULL) {
+			fprintf(worker->log, "Cached file %s is missing. "
+				"Not using cache for %s\n", path, f->name);
+			ret = 1;
+			goto out;
+		}
+		record_file(container, ben_str_val(str), aux->data, aux->size,
+			    &collection_context, path);
+		uade_file_free(aux);
+	}
 
 	meta_set_song(container, f);
+	meta_set_modland_authors(container, f);
+	store_shared_files(container);
 
-	ret = write_rmc(targetname, container);
+	fprintf(worker->log, "Converting %s to %s (cached)\n",
+		f->name, targetname);
+
+	ret = write_rmc(targetname, container, &worker->stats);
+	worker->stats.result = ret == 0 ? "cached" : "failed";
 
 	if (ret == 0 && delete_after_packing)
 		ret = remove_collected_files(&collection_context);
 
-	goto exit;
-
-error:
-	ret = -1;
-exit:
-	uade_set_amiga_loader(NULL, NULL, state);
+out:
 	ben_free(container);
 	ben_free(collection_context.filelist);
 	return ret;
 }
 
-static void initialize_config(struct uade_config *config)
+static void worker_new_state(struct worker *worker)
 {
-	char buf[16];
-	uade_config_set_defaults(config);
-	snprintf(buf, sizeof buf, "%d", FREQUENCY);
-	uade_config_set_option(config, UC_FREQUENCY, buf);
-	uade_config_set_option(config, UC_ENABLE_TIMEOUTS, NULL);
-	uade_config_set_option(config, UC_SILENCE_TIMEOUT_VALUE, "20");
-
-	snprintf(buf, sizeof buf, "%d", subsong_timeout);
-	uade_config_set_option(config, UC_SUBSONG_TIMEOUT_VALUE, buf);
-
-	uade_config_set_option(config, UC_TIMEOUT_VALUE, "-1");
+	if (worker->state != NULL)
+		return;
+	pthread_mutex_lock(&uade_state_lock);
+	worker->state = uade_new_state(worker->config);
+	pthread_mutex_unlock(&uade_state_lock);
+	if (worker->state == NULL)
+		z_die("Can not initialize uade state\n");
 }
 
-static void print_usage(void)
+static void add_subsong_stats(struct file_stats *stats, int subsong,
+			      double wall, double emulated)
 {
-	printf(
-"Usage: rmc [-d|-h|-n|-r|-u|-w t] [file1 file2 ..]\n"
-"\n"
-"-d      Delete song after successful packing. This can be reversed with -u,\n"
-"        that is, obtain the original song file by unpacking the container.\n"
-"-h      Print help.\n"
-"-n      Do not overwrite an existing rmc file. This can be used for\n"
-"        incremental conversion of directories.\n"
-"-r      Scan given directories recursively and process everything.\n"
-"-u dir  Unpack mode: unpack RMC meta and song files to the given directory.\n"
-"-w t    Set subsong timeout to be t seconds.\n"
-"\n"
-"Pack fc14.arcane-theme into arcane-theme.rmc:\n"
-"\n"
-"$ rmc fc14.arcane-theme\n"
-"\n"
+	struct subsong_stats *subsongs;
+	if (stats->nsubsongs == stats->allocated) {
+		stats->allocated = stats->allocated ? 2 * stats->allocated : 8;
+		subsongs = realloc(stats->subsongs,
+				   stats->allocated * sizeof subsongs[0]);
+		if (subsongs == NULL)
+			z_die("No memory for subsong statistics\n");
+		stats->subsongs = subsongs;
+	}
+	stats->subsongs[stats->nsubsongs++] = (struct subsong_stats) {
+		.subsong = subsong, .wall = wall, .emulated = emulated};
+}
 
-"\n"
-"Unpack arcane-theme.rmc into tmp/files/fc14.arcane-theme:\n"
-"\n"
-"$ mkdir tmp\n"
-"$ rmc -u tmp arcane-theme.rmc\n"
-		);
+/*
+ * Emulated time budget of a file (--file-budget and --batch-budget). Each
+ * subsong reserves an equal share of the time that is left when the
+ * subsong starts, and returns the unused part of its share when it ends.
+ * Subsongs that end early thereby leave more time for the other subsongs.
+ */
+struct time_budget {
+	pthread_mutex_t lock;
+	int limited;
+	double left;
+	int nleft;
+};
+
+/* Subsongs always get at least this many seconds */
+#define MIN_SUBSONG_BUDGET 1.0
+
+static void time_budget_init(struct time_budget *budget, double seconds,
+			     int nsubsongs)
+{
+	pthread_mutex_init(&budget->lock, NULL);
+	budget->limited = seconds >= 0;
+	budget->left = seconds;
+	budget->nleft = nsubsongs;
 }
 
-static int directory_traverse_fn(const char *fpath, const struct stat *sb,
-				 int typeflag)
+/* Returns the time allowed for the next subsong, or 0 if unlimited */
+static double time_budget_reserve(struct time_budget *budget)
 {
-	(void) sb;
-	if (typeflag != FTW_F)
-		return 0;
-	if (ben_list_append_str(scanner_file_list, fpath))
-		z_die("No memory to append file %s to scanner list\n", fpath);
-	return 0;
+	double share = 0;
+	pthread_mutex_lock(&budget->lock);
+	if (budget->limited) {
+		share = budget->left / (budget->nleft > 0 ? budget->nleft : 1);
+		if (share < MIN_SUBSONG_BUDGET)
+			share = MIN_SUBSONG_BUDGET;
+		budget->left -= share;
+		budget->nleft--;
+	}
+	pthread_mutex_unlock(&budget->lock);
+	return share;
 }
 
-void repack_container(const char *path)
+static void time_budget_refund(struct time_budget *budget, double share,
+			       double used)
 {
-	(void) path;
-	char *repack_dir = z_mkdtemp(NULL);
-	z_assert(repack_dir != NULL);
+	pthread_mutex_lock(&budget->lock);
+	if (budget->limited)
+		budget->left += share - used;
+	pthread_mutex_unlock(&budget->lock);
+}
 
-	z_assert(z_rmdir_recursively(repack_dir));
-	free(repack_dir);
+/*
+ * Get the emulated time budget for the next file in seconds, or -1 if the
+ * time is unlimited. The batch budget is shared evenly by the files that
+ * have not been converted yet. The share is reserved from the batch budget
+ * so that files being converted by other workers are accounted for, and
+ * *reserved is set to it for use_batch_budget().
+ */
+static double get_file_budget(struct work_queue *queue, double *reserved)
+{
+	double budget = file_budget > 0 ? file_budget : -1;
+	double share;
+	size_t nfiles;
+
+	*reserved = 0;
+	if (batch_budget <= 0)
+		return budget;
+
+	nfiles = work_queue_len(queue) + 1;
+
+	pthread_mutex_lock(&batch_budget_lock);
+	share = batch_budget_left / nfiles;
+	if (share < 0)
+		share = 0;
+	if (budget < 0 || share < budget)
+		budget = share;
+	batch_budget_left -= budget;
+	*reserved = budget;
+	pthread_mutex_unlock(&batch_budget_lock);
+	return budget;
 }
 
-static int put_files_into_container(int i, int argc, char *argv[],
-				    char *_unused)
+/* Return the unused part of a reserved share to the batch budget */
+static void use_batch_budget(double reserved, double seconds)
 {
-	int ret;
-	struct uade_state *state = NULL;
-	int exitval = 0;
-	struct uade_config *config = uade_new_config();
-	size_t pos;
-	struct bencode *benarg;
+	pthread_mutex_lock(&batch_budget_lock);
+	batch_budget_left += reserved - seconds;
+	pthread_mutex_unlock(&batch_budget_lock);
+}
 
-	(void) _unused;
+/* Mark length of a subsong as an estimate in meta */
+static void set_estimated(struct bencode *container, int sub)
+{
+	struct bencode *meta = ben_list_get(container, 1);
+	struct bencode *list = ben_dict_get_by_str(meta, "estimated_subsongs");
+	if (list == NULL) {
+		list = ben_list();
+		if (list == NULL ||
+		    ben_dict_set_by_str(meta, "estimated_subsongs", list))
+			z_die("Can not add estimated subsongs to meta\n");
+	}
+	if (ben_list_append_int(list, sub))
+		z_die("Can not mark subsong %d as estimated\n", sub);
+}
 
+/* How simulate_subsong() starts a subsong */
+enum subsong_start {
+	/* Initialize the emulator and play the song from the beginning */
+	SUBSONG_RESTART,
+	/* The state is already playing the subsong from the beginning */
+	SUBSONG_PLAYING,
 	/*
-	 * Use a global variable because ftw() call does not allow an opaque
-	 * data parameter for directory scanning. Dirty.
+	 * Start the next subsong. With --switch-subsongs, change to it in
+	 * the running session if possible. Otherwise restart.
 	 */
-	assert(scanner_file_list == NULL);
-	scanner_file_list = ben_list();
-	if (scanner_file_list == NULL)
-		z_die("No memory for scanner file list\n");
-
-	if (config == NULL)
-		z_die("Could not allocate memory for config\n");
+	SUBSONG_SWITCH,
+};
 
-	initialize_config(config);
+/*
+ * Change to subsong cur, which follows the current subsong, without
+ * reloading the song and the eagleplayer. Returns 0 on success, or -1 if
+ * the session can not change subsongs, and the song must be restarted.
+ */
+static int switch_subsong(struct uade_state *state, int cur)
+{
+	if (uade_next_subsong(state) < 0)
+		return -1;
+	return uade_get_song_info(state)->subsongs.cur == cur ? 0 : -1;
+}
 
-	for (; i < argc; i++) {
-		struct stat st;
-		if (stat(argv[i], &st)) {
-			fprintf(stderr, "Can not stat %s. Skipping.\n",
-				argv[i]);
-			continue;
-		}
-		if (S_ISDIR(st.st_mode)) {
-			ret = ftw(argv[i], directory_traverse_fn, 500);
-			if (ret != 0)
-				z_die("Traversing directory %s failed\n",
-				    argv[i]);
+/*
+ * Play subsong cur of f and simulate it to the end within the time budget.
+ * Song info is recorded into meta. The session is left running so that
+ * the next subsong can be switched to. Returns the play time in
+ * milliseconds, or -1 on error. worker->subsong_estimated is set if the
+ * budget ended the subsong.
+ */
+static int simulate_subsong(struct worker *worker, struct uade_file *f,
+			    struct bencode *meta, int cur,
+			    enum subsong_start start,
+			    struct time_budget *budget)
+{
+	size_t subsongbytes;
+	int bytespersecond;
+	double share;
+	double simulated_time = worker->simulated_time;
+	double t = gettime();
+	int ret = 1;
+
+	if (start == SUBSONG_SWITCH) {
+		if (switch_subsongs &&
+		    switch_subsong(worker->state, cur) == 0) {
+			worker->stats.reinits_avoided++;
 		} else {
-			ben_list_append_str(scanner_file_list, argv[i]);
+			uade_stop(worker->state);
+			start = SUBSONG_RESTART;
 		}
+	} else if (start == SUBSONG_PLAYING) {
+		worker->stats.reinits_avoided++;
+	}
+	if (start == SUBSONG_RESTART)
+		ret = uade_play_from_buffer(f->name, f->data, f->size, cur,
+					    worker->state);
+	if (ret < 0) {
+		uade_cleanup_state(worker->state);
+		worker->state = NULL;
+		z_log_warning("Error in uade state when initializing %s\n",
+			      f->name);
+		return -1;
+	} else if (ret == 0) {
+		fprintf(worker->log, "%s is not playable\n", f->name);
+		return -1;
 	}
 
-	ben_list_for_each(benarg, pos, scanner_file_list) {
-		const char *arg = ben_str_val(benarg);
-		struct uade_file *f = uade_file_load(arg);
-		if (f == NULL) {
-			z_log_error("Can not open %s\n", arg);
-			continue;
-		}
+	set_info(meta, worker->state);
+
+	bytespersecond = uade_get_sampling_rate(worker->state) *
+		UADE_BYTES_PER_FRAME;
+	share = time_budget_reserve(budget);
+	worker->max_subsong_bytes = share * bytespersecond;
+	subsongbytes = simulate(worker);
+	time_budget_refund(budget, share,
+			   worker->simulated_time - simulated_time);
+	add_subsong_stats(&worker->stats, cur, gettime() - t,
+			  worker->simulated_time - simulated_time);
+	if (subsongbytes == ((size_t) -1))
+		return -1;
 
-		if (uade_is_rmc(f->data, f->size)) {
-			if (repack_mode) {
-				repack_container(arg);
-				z_die("repack not implemented\n");
-			}
-			fprintf(stderr, "Won't convert RMC again: %s\n",
-				f->name);
-			uade_file_free(f);
-			continue;
-		}
+	return (subsongbytes * 1000) / bytespersecond;
+}
 
-		if (state == NULL)
-			state = uade_new_state(config);
-		if (state == NULL)
-			z_die("Can not initialize uade state\n");
+/*
+ * Parallel subsong simulation (-J n). Each subsong is simulated into a
+ * private container by a worker that has its own uade state. The results
+ * are merged back in subsong order, which gives the same container as
+ * simulating the subsongs one after another.
+ */
+struct subsong_result {
+	int playtime;
+	int estimated;
+	struct bencode *container;
+	struct collection_context context;
+	char *log;
+	size_t logsize;
+};
 
-		ret = uade_play_from_buffer(f->name, f->data, f->size, -1,
-					    state);
-		if (ret < 0) {
-			uade_cleanup_state(state);
-			state = NULL;
-			z_log_error("Can not convert (play) %s\n", arg);
-			goto nextfile;
-		} else if (ret == 0) {
-			fprintf(stderr, "%s is not playable (convertable)\n", arg);
-			goto nextfile;
-		}
+struct subsong_job {
+	struct uade_file *f;
+	int min;
+	int max;
+	int next;
+	pthread_mutex_t lock;
+	struct subsong_result *results;
+	struct time_budget *budget;
+};
 
-		if (convert(f, state))
-			exitval = 1;
+struct subsong_worker {
+	struct worker worker;
+	struct subsong_job *job;
+};
 
-	nextfile:
-		uade_file_free(f);
-		if (state != NULL)
-			uade_stop(state);
+static int next_subsong(struct subsong_job *job)
+{
+	int cur = -1;
+	pthread_mutex_lock(&job->lock);
+	if (job->next <= job->max) {
+		cur = job->next;
+		job->next++;
 	}
+	pthread_mutex_unlock(&job->lock);
+	return cur;
+}
+
+static void *subsong_worker_fn(void *arg)
+{
+	struct subsong_worker *subsong_worker = arg;
+	struct worker *worker = &subsong_worker->worker;
+	struct subsong_job *job = subsong_worker->job;
+	struct subsong_result *r;
+	int cur;
+
+	while ((cur = next_subsong(job)) >= 0) {
+		r = &job->results[cur - job->min];
+		worker->log = open_memstream(&r->log, &r->logsize);
+		if (worker->log == NULL)
+			z_die("Can not allocate log buffer for subsong %d\n",
+			      cur);
+
+		worker_new_state(worker);
+
+		r->container = create_container();
+		init_collection_context(&r->context, r->container, job->f,
+					worker);
+		uade_set_amiga_loader(collect_files, &r->context,
+				      worker->state);
+
+		r->playtime = simulate_subsong(
+			worker, job->f, ben_list_get(r->container, 1), cur,
+			SUBSONG_RESTART, job->budget);
+		r->estimated = worker->subsong_estimated;
+
+		if (worker->state != NULL) {
+			uade_stop(worker->state);
+			uade_set_amiga_loader(NULL, NULL, worker->state);
+		}
+		fclose(worker->log);
+		worker->log = NULL;
+	}
+	return NULL;
+}
+
+static void merge_files(struct bencode *dst, const struct bencode *src)
+{
+	size_t pos;
+	struct bencode *key;
+	struct bencode *value;
+	struct bencode *old;
+
+	ben_dict_for_each(key, value, pos, src) {
+		old = ben_dict_get(dst, key);
+		if (old != NULL) {
+			/* The first recorded file wins, as in collect_files() */
+			if (ben_is_dict(old) && ben_is_dict(value))
+				merge_files(old, value);
+			continue;
+		}
+		if (ben_dict_set(dst, ben_clone(key), ben_clone(value)))
+			z_die("Can not merge file %s\n", ben_str_val(key));
+	}
+}
+
+static void merge_meta(struct bencode *dst, const struct bencode *src)
+{
+	size_t pos;
+	struct bencode *key;
+	struct bencode *value;
+	struct bencode *old;
+	struct bencode *hkey;
+	struct bencode *hvalue;
+	size_t hpos;
+
+	ben_dict_for_each(key, value, pos, src) {
+		if (ben_is_str(key) &&
+		    strcmp(ben_str_val(key), "subsongs") == 0)
+			continue;
+		/* Each state collects its own files */
+		old = ben_dict_get(dst, key);
+		if (ben_is_str(key) &&
+		    strcmp(ben_str_val(key), "file_hashes") == 0 &&
+		    old != NULL && ben_is_dict(old) && ben_is_dict(value)) {
+			ben_dict_for_each(hkey, hvalue, hpos, value) {
+				/* The first recorded file wins */
+				if (ben_dict_get(old, hkey) != NULL)
+					continue;
+				if (ben_dict_set(old, ben_clone(hkey),
+						 ben_clone(hvalue)))
+					z_die("Can not merge file hashes\n");
+			}
+			continue;
+		}
+		if (ben_dict_set(dst, ben_clone(key), ben_clone(value)))
+			z_die("Can not merge meta key %s\n", ben_str_val(key));
+	}
+}
+
+static void merge_filelist(struct bencode *dst, const struct bencode *src)
+{
+	size_t pos;
+	size_t oldpos;
+	struct bencode *str;
+	struct bencode *old;
+	int found;
+
+	ben_list_for_each(str, pos, src) {
+		found = 0;
+		ben_list_for_each(old, oldpos, dst) {
+			if (ben_cmp(old, str) == 0) {
+				found = 1;
+				break;
+			}
+		}
+		if (!found && ben_list_append(dst, ben_clone(str)))
+			z_die("Can not merge file list\n");
+	}
+}
+
+/* Returns the sum of subsong play times, or -1 on error */
+static int simulate_subsongs_in_parallel(struct worker *worker,
+					 struct uade_file *f,
+					 struct collection_context *context,
+					 int min, int max,
+					 struct time_budget *budget)
+{
+	struct bencode *container = context->container;
+	struct bencode *meta = ben_list_get(container, 1);
+	int nsubsongs = max - min + 1;
+	int nthreads = subsong_jobs < nsubsongs ? subsong_jobs : nsubsongs;
+	struct subsong_job job = {.f = f, .min = min, .max = max, .next = min,
+				  .budget = budget};
+	struct subsong_worker *workers;
+	struct subsong_result *r;
+	int sumtime = 0;
+	int cur;
+	int j;
+
+	pthread_mutex_init(&job.lock, NULL);
+	job.results = calloc(nsubsongs, sizeof job.results[0]);
+	workers = calloc(nthreads, sizeof workers[0]);
+	if (job.results == NULL || workers == NULL)
+		z_die("No memory for parallel subsong simulation\n");
+
+	for (j = 0; j < nthreads; j++) {
+		workers[j].worker = (struct worker) {.id = worker->id,
+						     .config = worker->config};
+		workers[j].job = &job;
+	}
+	/* Lend the state of this worker to the first subsong worker */
+	workers[0].worker.state = worker->state;
+	worker->state = NULL;
+
+	for (j = 1; j < nthreads; j++) {
+		if (pthread_create(&workers[j].worker.thread, NULL,
+				   subsong_worker_fn, &workers[j]))
+			z_die("Can not create subsong thread %d\n", j);
+	}
+	subsong_worker_fn(&workers[0]);
+	for (j = 1; j < nthreads; j++) {
+		pthread_join(workers[j].worker.thread, NULL);
+		uade_cleanup_state(workers[j].worker.state);
+	}
+	worker->state = workers[0].worker.state;
+	for (j = 0; j < nthreads; j++) {
+		struct worker *w = &workers[j].worker;
+		size_t k;
+		worker->loop_saved_time += w->loop_saved_time;
+		worker->simulated_time += w->simulated_time;
+		worker->stats.collect += w->stats.collect;
+		for (k = 0; k < w->stats.nsubsongs; k++) {
+			add_subsong_stats(&worker->stats,
+					  w->stats.subsongs[k].subsong,
+					  w->stats.subsongs[k].wall,
+					  w->stats.subsongs[k].emulated);
+		}
+		free(w->stats.subsongs);
+	}
+
+	for (cur = min; cur <= max; cur++) {
+		r = &job.results[cur - min];
+		fprintf(worker->log, "Converting subsong %d / %d\n", cur, max);
+		xfwrite(r->log, 1, r->logsize, worker->log);
+		if (sumtime >= 0 && r->playtime >= 0) {
+			merge_meta(meta, ben_list_get(r->container, 1));
+			merge_files(ben_list_get(container, 2),
+				    ben_list_get(r->container, 2));
+			merge_filelist(context->filelist, r->context.filelist);
+			set_playtime(worker, container, cur, r->playtime);
+			if (r->estimated)
+				set_estimated(container, cur);
+			sumtime += r->playtime;
+		} else {
+			sumtime = -1;
+		}
+		ben_free(r->container);
+		ben_free(r->context.filelist);
+		free(r->log);
+	}
+
+	free(workers);
+	free(job.results);
+	pthread_mutex_destroy(&job.lock);
+	return sumtime;
+}
+
+/*
+ * Simulate subsongs min..max one after another in the state of the worker,
+ * and set their play times into container. If playing is set, the state is
+ * already playing subsong min. Returns the sum of play times, or -1 on
+ * error.
+ */
+static int simulate_subsongs(struct worker *worker, struct uade_file *f,
+			     struct bencode *container, int min, int max,
+			     int playing, struct time_budget *budget)
+{
+	struct bencode *meta = ben_list_get(container, 1);
+	int sumtime = 0;
+	int playtime;
+	int cur;
+
+	for (cur = min; cur <= max; cur++) {
+		if (max > min)
+			fprintf(worker->log, "Converting subsong %d / %d\n",
+				cur, max);
+
+		playtime = simulate_subsong(
+			worker, f, meta, cur,
+			cur > min ? SUBSONG_SWITCH :
+			playing ? SUBSONG_PLAYING : SUBSONG_RESTART,
+			budget);
+		if (playtime < 0)
+			return -1;
+
+		set_playtime(worker, container, cur, playtime);
+		if (worker->subsong_estimated)
+			set_estimated(container, cur);
+		sumtime += playtime;
+	}
+	return sumtime;
+}
+
+/*
+ * Convert f into an RMC file. The state is playing the default subsong of
+ * f after probing it, and files loaded by the probe were recorded into
+ * the container of collection_context.
+ */
+static int convert(struct uade_file *f, struct worker *worker,
+		   struct collection_context *collection_context,
+		   const struct rmc_hash *cache_key)
+{
+	struct uade_state *state = worker->state;
+	const struct uade_song_info *info = uade_get_song_info(state);
+	int min = info->subsongs.min;
+	int max = info->subsongs.max;
+	int playing;
+	int ret = 0;
+	long long starttime;
+	long long simtime;
+	int sumtime = 0;
+	int nsubsongs = max - min + 1;
+	struct bencode *container = collection_context->container;
+	struct bencode *meta = ben_list_get(container, 1);
+	struct bencode *cache_entry = NULL;
+	char targetname[PATH_MAX];
+	struct time_budget budget;
+	double batch_share;
+	struct stat st;
+
+	assert(nsubsongs > 0);
+
+	get_targetname(targetname, sizeof targetname, state);
+
+	if (stat(targetname, &st) == 0 &&
+	    overwrite_mode == 0) {
+		fprintf(worker->log,
+			"Not overwriting file %s. Not converting file %s.\n",
+			targetname, f->name);
+		return 0;
+	}
+	fprintf(worker->log, "Converting %s to %s (%d subsongs)\n",
+	      f->name, targetname, nsubsongs);
+
+	/*
+	 * The probe session is simulated as the first subsong if it plays
+	 * that subsong. This saves one emulator initialization per file.
+	 */
+	playing = subsong_jobs <= 1 || nsubsongs == 1 ?
+		info->subsongs.cur == min : 0;
+	if (!playing)
+		uade_stop(state);
+
+	starttime = getmstime();
+	worker->loop_saved_time = 0;
+	worker->simulated_time = 0;
+	time_budget_init(&budget, get_file_budget(worker->queue, &batch_share),
+			 nsubsongs);
+
+	if (subsong_jobs > 1 && nsubsongs > 1) {
+		sumtime = simulate_subsongs_in_parallel(
+			worker, f, collection_context, min, max, &budget);
+		if (sumtime < 0)
+			goto error;
+	} else {
+		sumtime = simulate_subsongs(worker, f, container, min, max,
+					    playing, &budget);
+		if (sumtime < 0)
+			goto error;
+	}
+
+	simtime = getmstime() - starttime;
+	if (simtime < 0)
+		simtime = 0;
+	fprintf(worker->log, "play time %d ms, simulation time %lld ms, "
+		"speedup %.1fx\n",
+		sumtime, simtime, ((float) sumtime) / simtime);
+	if (worker->loop_saved_time > 0)
+		fprintf(worker->log, "loop detection saved up to %.1f s of "
+			"simulation\n", worker->loop_saved_time);
+	if (worker->stats.reinits_avoided > 0)
+		fprintf(worker->log, "%d emulator re-initializations "
+			"avoided\n", worker->stats.reinits_avoided);
+
+	meta_set_song(container, f);
+
+	/* Estimates depend on the budget. Only cache measured results. */
+	if (cache_key != NULL &&
+	    ben_dict_get_by_str(meta, "estimated_subsongs") == NULL)
+		cache_entry = cache_entry_create(container, f,
+						 info->detectioninfo.ext);
+
+	meta_set_modland_authors(container, f);
+	store_shared_files(container);
+
+	ret = write_rmc(targetname, container, &worker->stats);
+	worker->stats.result = ret == 0 ? "converted" : "failed";
+
+	if (ret == 0 && cache_entry != NULL)
+		cache_store(cache_key, cache_entry);
+
+	if (ret == 0 && delete_after_packing)
+		ret = remove_collected_files(collection_context);
+
+	goto exit;
+
+error:
+	ret = -1;
+exit:
+	ben_free(cache_entry);
+	use_batch_budget(batch_share, worker->simulated_time);
+	pthread_mutex_destroy(&budget.lock);
+	return ret;
+}
+
+static void initialize_config(struct uade_config *config)
+{
+	char buf[16];
+	uade_config_set_defaults(config);
+	snprintf(buf, sizeof buf, "%d", FREQUENCY);
+	uade_config_set_option(config, UC_FREQUENCY, buf);
+	uade_config_set_option(config, UC_ENABLE_TIMEOUTS, NULL);
+	snprintf(buf, sizeof buf, "%d", SILENCE_TIMEOUT);
+	uade_config_set_option(config, UC_SILENCE_TIMEOUT_VALUE, buf);
+
+	snprintf(buf, sizeof buf, "%d", subsong_timeout);
+	uade_config_set_option(config, UC_SUBSONG_TIMEOUT_VALUE, buf);
+
+	uade_config_set_option(config, UC_TIMEOUT_VALUE, "-1");
+}
+
+static void print_usage(void)
+{
+	printf(
+"Usage: rmc [-c dir|-d|-h|-j n|-J n|-l t|-n|-r|-s|-u|-w t] [file1 file2 ..]\n"
+"\n"
+"-c dir  Cache conversion results in dir. Songs with the same contents are\n"
+"        converted from the cache without emulation.\n"
+"-d      Delete song after successful packing. This can be reversed with -u,\n"
+"        that is, obtain the original song file by unpacking the container.\n"
+"-h      Print help.\n"
+"-j n    Convert n files in parallel, each with its own uade state.\n"
+"-J n    Simulate n subsongs of a file in parallel, each with its own\n"
+"        uade state.\n"
+"-l t    End a subsong when its audio output repeats exactly for at least\n"
+"        t seconds, and use the loop point as the subsong length. This is\n"
+"        useful for songs that never signal a song end.\n"
+"-n      Do not overwrite an existing rmc file. This can be used for\n"
+"        incremental conversion of directories.\n"
+"-r      Scan given directories recursively and process everything.\n"
+"-s      Show metadata of given RMC files and directories, one line per\n"
+"        file. Only the meta part of each file is read.\n"
+"-u dir  Unpack mode: unpack RMC meta and song files to the given directory.\n"
+"        With -r, each RMC file in the given directories is unpacked in\n"
+"        parallel (-j n) to its own directory under dir, which mirrors the\n"
+"        directory tree.\n"
+"-w t    Set subsong timeout to be t seconds.\n"
+"\n"
+"--batch-budget=t         Simulate at most about t seconds of audio in total.\n"
+"                         The time is shared by the files to convert.\n"
+"--file-budget=t          Simulate at most about t seconds of audio per file.\n"
+"                         The time is shared by subsongs of the file. Time\n"
+"                         left from short subsongs is given to the others.\n"
+"                         Subsongs cut by a budget are listed in\n"
+"                         meta['estimated_subsongs'].\n"
+"--file-cache=n           Keep up to n MiB of files loaded by eagleplayers\n"
+"                         in memory (default 64). 0 disables the cache.\n"
+"--bundle-create=b        Create bundle b from given RMC files and\n"
+"                         directories. Containers in directories are named\n"
+"                         by their path relative to the directory.\n"
+"--bundle-append=b        Append given RMC files and directories to bundle b.\n"
+"--bundle-list            List containers of given bundles with their meta.\n"
+"--bundle-extract=dir     Extract containers from a bundle to dir:\n"
+"                         rmc --bundle-extract=dir bundle [name ...]\n"
+"--bench-codec            Benchmark container encoding and decoding with\n"
+"                         synthetic containers. Prints CSV.\n"
+"--entry=name             With -u, unpack only the file name of the\n"
+"                         container to dir/files/name, e.g. a song in a\n"
+"                         large container. Directories are separated\n"
+"                         with '/'.\n"
+"--index=file             Create or update a collection index of given RMC\n"
+"                         files and directories. Only files whose mtime or\n"
+"                         size changed are read again. See\n"
+"                         doc/rmc-index-format.\n"
+"--index-list             List records of an index by path or content hash:\n"
+"                         rmc --index-list index [path|hash ...]\n"
+"--modland=file           Fill meta['authors'] of converted songs from\n"
+"                         Modland's allmods_md5.txt, if the md5 of the song\n"
+"                         is in the list and the song has no authors.\n"
+"--no-file-index          Do not write a file index into created\n"
+"                         containers. The index lets readers find a file\n"
+"                         without parsing the files dictionary.\n"
+"--no-io-uring            Do not use io_uring for batched file I/O in pack\n"
+"                         and unpack.\n"
+"--repack[=mode]          Repack existing RMC files in place. Directories\n"
+"                         are scanned as in conversion. mode 'meta' (the\n"
+"                         default) renormalizes meta without simulation.\n"
+"                         mode 'full' also simulates subsong lengths\n"
+"                         again. Song files are copied as they are.\n"
+"--silence-window=t       End a subsong after t seconds of silence that\n"
+"                         follows audible output. Trailing silence is\n"
+"                         trimmed from the subsong length.\n"
+"--silence-threshold=n    Samples with amplitude at most n are silent\n"
+"                         (default 16).\n"
+"--stats-fd=n             Write timing statistics of each converted file\n"
+"                         to file descriptor n as one JSON object per line.\n"
+"--store=dir              Move files other than the song out of converted\n"
+"                         containers to a shared store in dir, named by\n"
+"                         content hash, so that files shared by many songs\n"
+"                         are stored once. With -u, restore them from dir.\n"
+"--switch-subsongs        Change to the next subsong in the running\n"
+"                         emulator session instead of restarting the song.\n"
+"                         This is faster, but subsong lengths may differ\n"
+"                         from a restart, e.g. from -J output.\n"
+"\n"
+"Pack fc14.arcane-theme into arcane-theme.rmc:\n"
+"\n"
+"$ rmc fc14.arcane-theme\n"
+"\n"
+
+"\n"
+"Unpack arcane-theme.rmc into tmp/files/fc14.arcane-theme:\n"
+"\n"
+"$ mkdir tmp\n"
+"$ rmc -u tmp arcane-theme.rmc\n"
+		);
+}
+
+static void get_thread_rusage(struct rusage *ru)
+{
+#ifdef RUSAGE_THREAD
+	getrusage(RUSAGE_THREAD, ru);
+#else
+	getrusage(RUSAGE_SELF, ru);
+#endif
+}
+
+static double timeval_diff(const struct timeval *a, const struct timeval *b)
+{
+	return (b->tv_sec - a->tv_sec) + (b->tv_usec - a->tv_usec) / 1e6;
+}
+
+static int compare_subsong_stats(const void *a, const void *b)
+{
+	const struct subsong_stats *x = a;
+	const struct subsong_stats *y = b;
+	return (x->subsong > y->subsong) - (x->subsong < y->subsong);
+}
+
+static void print_json_str(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s != 0; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+/* Write statistics of one file as a JSON object on one line */
+static void print_file_stats(struct file_stats *stats, const char *fname)
+{
+	struct rusage ru;
+	char *line = NULL;
+	size_t len = 0;
+	size_t i;
+	double emulated = 0;
+	FILE *f = open_memstream(&line, &len);
+
+	if (f == NULL)
+		z_die("No memory for statistics\n");
+
+	get_thread_rusage(&ru);
+	qsort(stats->subsongs, stats->nsubsongs, sizeof stats->subsongs[0],
+	      compare_subsong_stats);
+	for (i = 0; i < stats->nsubsongs; i++)
+		emulated += stats->subsongs[i].emulated;
+
+	fprintf(f, "{\"file\": ");
+	print_json_str(f, fname);
+	fprintf(f, ", \"result\": \"%s\", \"total_ms\": %.3f, "
+		"\"load_ms\": %.3f, \"detect_ms\": %.3f, "
+		"\"collect_ms\": %.3f, \"encode_ms\": %.3f, "
+		"\"write_ms\": %.3f, \"emulated_ms\": %.0f, "
+		"\"user_cpu_ms\": %.3f, \"sys_cpu_ms\": %.3f, "
+		"\"reinits_avoided\": %d, \"subsongs\": [",
+		stats->result, 1000 * (gettime() - stats->start),
+		1000 * stats->load, 1000 * stats->detect,
+		1000 * stats->collect, 1000 * stats->encode,
+		1000 * stats->write, 1000 * emulated,
+		1000 * timeval_diff(&stats->rusage.ru_utime, &ru.ru_utime),
+		1000 * timeval_diff(&stats->rusage.ru_stime, &ru.ru_stime),
+		stats->reinits_avoided);
+	for (i = 0; i < stats->nsubsongs; i++) {
+		fprintf(f, "%s{\"subsong\": %d, \"wall_ms\": %.3f, "
+			"\"emulated_ms\": %.0f}",
+			i > 0 ? ", " : "", stats->subsongs[i].subsong,
+			1000 * stats->subsongs[i].wall,
+			1000 * stats->subsongs[i].emulated);
+	}
+	fprintf(f, "]}\n");
+	fclose(f);
+
+	flockfile(stats_file);
+	xfwrite(line, 1, len, stats_file);
+	fflush(stats_file);
+	funlockfile(stats_file);
+	free(line);
+}
+
+static void worker_begin_file(struct worker *worker)
+{
+	free(worker->stats.subsongs);
+	worker->stats = (struct file_stats) {.result = "skipped",
+					     .start = gettime()};
+	get_thread_rusage(&worker->stats.rusage);
+
+	if (njobs <= 1) {
+		worker->log = stderr;
+		return;
+	}
+	worker->log = open_memstream(&worker->logbuf, &worker->logsize);
+	if (worker->log == NULL)
+		z_die("Can not allocate log buffer for worker %d\n",
+		      worker->id);
+}
+
+static void worker_end_file(struct worker *worker, const char *fname)
+{
+	if (stats_file != NULL)
+		print_file_stats(&worker->stats, fname);
+
+	if (worker->log == stderr)
+		return;
+	fclose(worker->log);
+	worker->log = stderr;
+	flockfile(stderr);
+	xfwrite(worker->logbuf, 1, worker->logsize, stderr);
+	funlockfile(stderr);
+	z_free_and_null(worker->logbuf);
+	worker->logsize = 0;
+}
+
+static int repack_file(struct worker *worker, struct uade_file *f);
+
+/* Returns non-zero if the file was playable but the conversion failed */
+static int convert_file(struct worker *worker, const char *arg)
+{
+	int ret;
+	int exitval = 0;
+	struct rmc_hash cache_key;
+	struct bencode *entry;
+	struct collection_context collection_context;
+	double t = gettime();
+	struct uade_file *f = uade_file_load(arg);
+	worker->stats.load = gettime() - t;
+	if (f == NULL) {
+		z_log_error("Can not open %s\n", arg);
+		worker->stats.result = "unreadable";
+		return 0;
+	}
+
+	if (uade_is_rmc(f->data, f->size)) {
+		if (repack_mode) {
+			exitval = repack_file(worker, f);
+			uade_file_free(f);
+			return exitval;
+		}
+		fprintf(worker->log, "Won't convert RMC again: %s\n",
+			f->name);
+		uade_file_free(f);
+		return 0;
+	}
+
+	if (repack_mode) {
+		fprintf(worker->log, "Not an RMC file. Not repacking %s\n",
+			f->name);
+		uade_file_free(f);
+		return 0;
+	}
+
+	if (cache_dir != NULL) {
+		get_cache_key(&cache_key, f);
+		entry = cache_lookup(&cache_key);
+		if (entry != NULL) {
+			ret = convert_cached(f, worker, entry);
+			ben_free(entry);
+			if (ret <= 0) {
+				uade_file_free(f);
+				return ret < 0;
+			}
+		}
+	}
+
+	worker_new_state(worker);
+
+	/*
+	 * Record files already when probing, because the probe session is
+	 * reused for simulating the first subsong.
+	 */
+	init_collection_context(&collection_context, create_container(), f,
+				worker);
+	uade_set_amiga_loader(collect_files, &collection_context,
+			      worker->state);
+
+	t = gettime();
+	ret = uade_play_from_buffer(f->name, f->data, f->size, -1,
+				    worker->state);
+	worker->stats.detect = gettime() - t;
+	if (ret < 0) {
+		uade_cleanup_state(worker->state);
+		worker->state = NULL;
+		z_log_error("Can not convert (play) %s\n", arg);
+		worker->stats.result = "failed";
+		goto nextfile;
+	} else if (ret == 0) {
+		fprintf(worker->log, "%s is not playable (convertable)\n",
+			arg);
+		worker->stats.result = "not_playable";
+		goto nextfile;
+	}
+
+	if (convert(f, worker, &collection_context,
+		    cache_dir != NULL ? &cache_key : NULL)) {
+		worker->stats.result = "failed";
+		exitval = 1;
+	}
+
+nextfile:
+	if (worker->state != NULL) {
+		uade_set_amiga_loader(NULL, NULL, worker->state);
+		uade_stop(worker->state);
+	}
+	ben_free(collection_context.container);
+	ben_free(collection_context.filelist);
+	uade_file_free(f);
+	return exitval;
+}
+
+static void *convert_worker(void *arg)
+{
+	struct worker *worker = arg;
+	char *fname;
+
+	while ((fname = work_queue_pop(worker->queue)) != NULL) {
+		worker_begin_file(worker);
+		if (convert_file(worker, fname))
+			worker->exitval = 1;
+		worker_end_file(worker, fname);
+		free(fname);
+	}
+
+	/* state can be NULL */
+	uade_cleanup_state(worker->state);
+	worker->state = NULL;
+	z_free_and_null(worker->stats.subsongs);
+	return NULL;
+}
+
+struct scanner {
+	int i;
+	int argc;
+	char **argv;
+	struct work_queue *queue;
+	pthread_t thread;
+};
+
+/*
+ * Queue a scanned file. Temp files and containers that workers create in
+ * the tree being scanned are skipped. Repacking reads containers.
+ */
+static void scanner_walk_fn(const char *path, void *context)
+{
+	if (is_temp_file_name(path) || (!repack_mode && has_rmc_suffix(path)))
+		return;
+	work_queue_push(path, context);
+}
+
+static void *scanner_fn(void *arg)
+{
+	struct scanner *scanner = arg;
+	struct stat st;
+	int i;
+
+	for (i = scanner->i; i < scanner->argc; i++) {
+		const char *path = scanner->argv[i];
+		if (stat(path, &st)) {
+			fprintf(stderr, "Can not stat %s. Skipping.\n", path);
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			if (walk_tree(path, scanner_walk_fn, scanner->queue))
+				z_die("Traversing directory %s failed\n",
+				      path);
+		} else {
+			work_queue_push(path, scanner->queue);
+		}
+	}
+	work_queue_finish(scanner->queue);
+	return NULL;
+}
+
+static int put_files_into_container(int i, int argc, char *argv[],
+				    char *_unused)
+{
+	int exitval = 0;
+	struct uade_config *config = uade_new_config();
+	struct work_queue queue;
+	struct scanner scanner = {.i = i, .argc = argc, .argv = argv,
+				  .queue = &queue};
+	struct worker *workers;
+	int j;
+
+	(void) _unused;
+
+	if (config == NULL)
+		z_die("Could not allocate memory for config\n");
+
+	initialize_config(config);
+
+	if (cache_dir != NULL && mkdir(cache_dir, 0777) && errno != EEXIST)
+		z_die("Can not create cache directory %s (%s)\n", cache_dir,
+		      strerror(errno));
+	if (store_dir != NULL && mkdir(store_dir, 0777) && errno != EEXIST)
+		z_die("Can not create store directory %s (%s)\n", store_dir,
+		      strerror(errno));
+
+	work_queue_init(&queue, batch_budget <= 0);
+
+	/* Files are converted while directories are still being scanned */
+	if (pthread_create(&scanner.thread, NULL, scanner_fn, &scanner))
+		z_die("Can not create scanner thread\n");
+
+	workers = calloc(njobs, sizeof workers[0]);
+	if (workers == NULL)
+		z_die("No memory for %d workers\n", njobs);
+
+	for (j = 0; j < njobs; j++) {
+		workers[j] = (struct worker) {.id = j, .config = config,
+					      .queue = &queue, .log = stderr};
+	}
+
+	if (njobs == 1) {
+		convert_worker(&workers[0]);
+	} else {
+		for (j = 0; j < njobs; j++) {
+			if (pthread_create(&workers[j].thread, NULL,
+					   convert_worker, &workers[j]))
+				z_die("Can not create worker thread %d\n", j);
+		}
+		for (j = 0; j < njobs; j++)
+			pthread_join(workers[j].thread, NULL);
+	}
+
+	pthread_join(scanner.thread, NULL);
+
+	for (j = 0; j < njobs; j++)
+		exitval |= workers[j].exitval;
+
+	print_file_cache_stats();
+
+	free(workers);
+	work_queue_free(&queue);
+	z_free_and_null(config);
+
+	return exitval;
+}
+
+
+/*
+ * Zero-copy RMC reader. The container file is mapped into memory and
+ * meta and files are exposed as views into the mapping. Only meta is
+ * ever decoded into bencode objects. File contents are never copied.
+ */
+
+/* Bytes before the meta dictionary: 'l9:' + RMC_MAGIC */
+#define RMC_PREFIX_LEN 12
+
+/* Maximum nesting of bencode values accepted by the reader */
+#define RMC_MAX_DEPTH 64
+
+struct rmc_view {
+	const char *data;
+	size_t size;
+};
+
+struct rmc_reader {
+	const char *fname;
+	void *map;
+	size_t mapsize;
+	const char *data;  /* the whole container */
+	struct rmc_view meta;  /* serialized meta dictionary */
+	struct rmc_view files;  /* serialized files dictionary */
+	struct rmc_view index;  /* serialized file index, size 0 if none */
+};
+
+struct rmc_dict_iter {
+	struct rmc_view dict;
+	size_t off;
+};
+
+/* Parse a string at data[*off], and set str to view its contents */
+static int view_parse_str(struct rmc_view *str, const char *data, size_t size,
+			  size_t *off)
+{
+	size_t pos = *off;
+	size_t len = 0;
+
+	if (pos >= size || data[pos] < '0' || data[pos] > '9')
+		return -1;
+	/* Leading zeros are not allowed */
+	if (data[pos] == '0' && pos + 1 < size && data[pos + 1] != ':')
+		return -1;
+	while (pos < size && data[pos] >= '0' && data[pos] <= '9') {
+		if (len > (SIZE_MAX - 9) / 10)
+			return -1;
+		len = len * 10 + (data[pos] - '0');
+		pos++;
+	}
+	if (pos >= size || data[pos] != ':')
+		return -1;
+	pos++;
+	if (len > size - pos)
+		return -1;
+	*str = (struct rmc_view) {.data = data + pos, .size = len};
+	*off = pos + len;
+	return 0;
+}
+
+/* Skip the value at data[*off]. Sets *off to the end of the value. */
+static int view_skip(const char *data, size_t size, size_t *off, int depth)
+{
+	struct rmc_view str;
+	size_t pos = *off;
+
+	if (pos >= size || depth > RMC_MAX_DEPTH)
+		return -1;
+
+	switch (data[pos]) {
+	case 'i':
+		pos++;
+		if (pos < size && data[pos] == '-')
+			pos++;
+		if (pos >= size || data[pos] < '0' || data[pos] > '9')
+			return -1;
+		while (pos < size && data[pos] >= '0' && data[pos] <= '9')
+			pos++;
+		if (pos >= size || data[pos] != 'e')
+			return -1;
+		*off = pos + 1;
+		return 0;
+	case 'l':
+	case 'd':
+		pos++;
+		while (pos < size && data[pos] != 'e') {
+			/* Keys are strings, or integers as in subsongs */
+			if (data[*off] == 'd' &&
+			    (data[pos] == 'i' ?
+			     view_skip(data, size, &pos, depth + 1) :
+			     view_parse_str(&str, data, size, &pos)))
+				return -1;
+			if (view_skip(data, size, &pos, depth + 1))
+				return -1;
+		}
+		if (pos >= size)
+			return -1;
+		*off = pos + 1;
+		return 0;
+	default:
+		return view_parse_str(&str, data, size, off);
+	}
+}
+
+static int view_is_dict(const struct rmc_view *v)
+{
+	return v->size > 0 && v->data[0] == 'd';
+}
+
+/* Get the contents of a serialized string value */
+static int view_get_str(struct rmc_view *str, const struct rmc_view *v)
+{
+	size_t off = 0;
+	if (view_parse_str(str, v->data, v->size, &off) || off != v->size)
+		return -1;
+	return 0;
+}
+
+/* Copy a string view into a '\0' terminated buffer */
+static int view_to_cstr(char *s, size_t maxlen, const struct rmc_view *v)
+{
+	if (v->size >= maxlen || memchr(v->data, 0, v->size) != NULL)
+		return -1;
+	memcpy(s, v->data, v->size);
+	s[v->size] = 0;
+	return 0;
+}
+
+static void rmc_dict_iter_init(struct rmc_dict_iter *iter,
+			       const struct rmc_view *dict)
+{
+	assert(view_is_dict(dict));
+	*iter = (struct rmc_dict_iter) {.dict = *dict, .off = 1};
+}
+
+/*
+ * Get the next key and value of a dictionary. key views the contents of
+ * the key string, value views the serialized value. Returns 1 if a
+ * key-value pair was returned, 0 at the end of dictionary, and -1 on error.
+ */
+static int rmc_dict_next(struct rmc_dict_iter *iter, struct rmc_view *key,
+			 struct rmc_view *value)
+{
+	const char *data = iter->dict.data;
+	size_t size = iter->dict.size;
+	size_t start;
+
+	if (iter->off >= size)
+		return -1;
+	if (data[iter->off] == 'e')
+		return 0;
+	if (view_parse_str(key, data, size, &iter->off))
+		return -1;
+	start = iter->off;
+	if (view_skip(data, size, &iter->off, 1))
+		return -1;
+	*value = (struct rmc_view) {.data = data + start,
+				    .size = iter->off - start};
+	return 1;
+}
+
+/* Parse a non-negative integer at data[*off] */
+static int view_parse_uint(uint64_t *x, const char *data, size_t size,
+			   size_t *off)
+{
+	size_t pos = *off;
+	uint64_t val = 0;
+
+	if (pos >= size || data[pos] != 'i')
+		return -1;
+	pos++;
+	if (pos >= size || data[pos] < '0' || data[pos] > '9')
+		return -1;
+	while (pos < size && data[pos] >= '0' && data[pos] <= '9') {
+		if (val > (UINT64_MAX - 9) / 10)
+			return -1;
+		val = val * 10 + (data[pos] - '0');
+		pos++;
+	}
+	if (pos >= size || data[pos] != 'e')
+		return -1;
+	*x = val;
+	*off = pos + 1;
+	return 0;
+}
+
+/*
+ * The file index is an optional item after the files dictionary. It maps
+ * the path of each file, directories separated with '/', to the offset
+ * and length of the file contents in the container. The index is
+ * followed by its own offset as a string of 16 hex digits, so that the
+ * index is found from the last 20 bytes of the file. See doc/rmc-format.
+ */
+#define FILE_INDEX_TRAILER_LEN 20
+
+static int add_file_index_entries(struct bencode *index, const char *data,
+				  const struct rmc_view *files,
+				  const char *oldprefix)
+{
+	struct rmc_dict_iter iter;
+	struct rmc_view key;
+	struct rmc_view value;
+	struct rmc_view content;
+	struct bencode *entry;
+	char name[PATH_MAX];
+	char path[PATH_MAX];
+	int ret;
+
+	rmc_dict_iter_init(&iter, files);
+	while ((ret = rmc_dict_next(&iter, &key, &value)) > 0) {
+		if (view_to_cstr(name, sizeof name, &key))
+			return -1;
+		ret = snprintf(path, sizeof path, "%s%s%s", oldprefix, name,
+			       view_is_dict(&value) ? "/" : "");
+		if (ret < 0 || ((size_t) ret) >= sizeof path)
+			return -1;
+		if (view_is_dict(&value)) {
+			if (add_file_index_entries(index, data, &value, path))
+				return -1;
+			continue;
+		}
+		if (view_get_str(&content, &value))
+			return -1;
+		entry = ben_list();
+		if (entry == NULL ||
+		    ben_list_append(entry, ben_int(content.data - data)) ||
+		    ben_list_append(entry, ben_int(content.size)) ||
+		    ben_dict_set_by_str(index, path, entry))
+			z_die("No memory for file index\n");
+	}
+	return ret;
+}
+
+/*
+ * Write the file index of the files dictionary that was written to f
+ * between offsets start and end. The index is built by mapping the
+ * written dictionary, so it works for every writer of the files.
+ */
+static int write_file_index(FILE *f, off_t start, off_t end)
+{
+	struct bencode *index = ben_dict();
+	struct rmc_view files;
+	void *map;
+	off_t offset;
+	int ret = -1;
+
+	if (index == NULL)
+		z_die("No memory for file index\n");
+	if (start <= 0 || end <= start || fflush(f))
+		goto out;
+	map = mmap(NULL, end, PROT_READ, MAP_SHARED, fileno(f), 0);
+	if (map == MAP_FAILED) {
+		z_log_error("Can not map written files (%s)\n",
+			    strerror(errno));
+		goto out;
+	}
+	files = (struct rmc_view) {.data = (const char *) map + start,
+				   .size = end - start};
+	if (view_is_dict(&files))
+		ret = add_file_index_entries(index, map, &files, "");
+	munmap(map, end);
+	if (ret) {
+		z_log_error("Can not index the files dictionary\n");
+		goto out;
+	}
+
+	offset = ftello(f);
+	if (offset < 0 || stream_value(f, index) ||
+	    fprintf(f, "16:%016llx", (unsigned long long) offset) < 0)
+		ret = -1;
+out:
+	ben_free(index);
+	return ret;
+}
+
+/*
+ * Find the file index from the end of a container whose files dictionary
+ * begins at files_start. Sets the files and index views of reader if the
+ * container has a valid index. The files dictionary is not walked, so
+ * opening a container with an index only touches its ends.
+ */
+static int rmc_reader_find_index(struct rmc_reader *reader, const char *data,
+				 size_t size, size_t files_start)
+{
+	const char *trailer;
+	size_t index_start = 0;
+	size_t off;
+	int i;
+
+	/* At least an empty files dictionary and an empty index */
+	if (size - files_start < 4 + FILE_INDEX_TRAILER_LEN + 1)
+		return -1;
+	trailer = data + size - FILE_INDEX_TRAILER_LEN;
+	if (memcmp(trailer, "16:", 3) != 0 ||
+	    trailer[FILE_INDEX_TRAILER_LEN - 1] != 'e')
+		return -1;
+	for (i = 3; i < 3 + 16; i++) {
+		if (trailer[i] >= '0' && trailer[i] <= '9')
+			index_start = (index_start << 4) | (trailer[i] - '0');
+		else if (trailer[i] >= 'a' && trailer[i] <= 'f')
+			index_start = (index_start << 4) |
+				(trailer[i] - 'a' + 10);
+		else
+			return -1;
+	}
+	if (index_start < files_start + 2 ||
+	    index_start >= size - FILE_INDEX_TRAILER_LEN ||
+	    data[index_start - 1] != 'e')
+		return -1;
+	off = index_start;
+	if (data[index_start] != 'd' || view_skip(data, size, &off, 1) ||
+	    off != size - FILE_INDEX_TRAILER_LEN)
+		return -1;
+
+	reader->files = (struct rmc_view) {.data = data + files_start,
+					   .size = index_start - files_start};
+	reader->index = (struct rmc_view) {.data = data + index_start,
+					   .size = off - index_start};
+	return 0;
+}
+
+/* Find file contents from the file index. Returns 1 if found. */
+static int rmc_reader_find_indexed(struct rmc_view *content,
+				   const struct rmc_reader *reader,
+				   const char *path)
+{
+	struct rmc_dict_iter iter;
+	struct rmc_view key;
+	struct rmc_view value;
+	size_t files_start = reader->files.data - reader->data;
+	size_t files_end = files_start + reader->files.size;
+	size_t len = strlen(path);
+	size_t off = 1;
+	uint64_t offset;
+	uint64_t size;
+	int ret;
+
+	rmc_dict_iter_init(&iter, &reader->index);
+	while ((ret = rmc_dict_next(&iter, &key, &value)) > 0) {
+		if (key.size == len && memcmp(key.data, path, len) == 0)
+			break;
+	}
+	if (ret <= 0)
+		return ret;
+
+	if (value.data[0] != 'l' ||
+	    view_parse_uint(&offset, value.data, value.size, &off) ||
+	    view_parse_uint(&size, value.data, value.size, &off) ||
+	    off + 1 != value.size || value.data[off] != 'e')
+		return -1;
+	/* The contents must be a string inside the files dictionary */
+	if (offset <= files_start || offset > files_end ||
+	    size > files_end - offset || reader->data[offset - 1] != ':')
+		return -1;
+	*content = (struct rmc_view) {.data = reader->data + offset,
+				      .size = size};
+	return 1;
+}
+
+/*
+ * Find file contents by path, e.g. 'dir/song.mod'. The file index is used
+ * if the container has one. Otherwise the files dictionary is searched
+ * one path component at a time. Returns 1 if the file was found, 0 if it
+ * was not, and -1 on invalid container.
+ */
+static int rmc_reader_find_file(struct rmc_view *content,
+				const struct rmc_reader *reader,
+				const char *path)
+{
+	struct rmc_dict_iter iter;
+	struct rmc_view dict = reader->files;
+	struct rmc_view key;
+	struct rmc_view value;
+	const char *slash;
+	size_t len;
+	int ret;
+
+	if (reader->index.size > 0)
+		return rmc_reader_find_indexed(content, reader, path);
+
+	while (1) {
+		slash = strchr(path, '/');
+		len = slash != NULL ? (size_t) (slash - path) : strlen(path);
+		rmc_dict_iter_init(&iter, &dict);
+		while ((ret = rmc_dict_next(&iter, &key, &value)) > 0) {
+			if (key.size == len && memcmp(key.data, path, len) == 0)
+				break;
+		}
+		if (ret <= 0)
+			return ret;
+		if (slash == NULL)
+			break;
+		if (!view_is_dict(&value))
+			return 0;
+		dict = value;
+		path = slash + 1;
+	}
+	if (view_is_dict(&value))
+		return 0;
+	return view_get_str(content, &value) ? -1 : 1;
+}
+
+static void rmc_reader_close(struct rmc_reader *reader)
+{
+	if (reader->map != NULL)
+		munmap(reader->map, reader->mapsize);
+	*reader = (struct rmc_reader) {.map = NULL};
+}
+
+/* Find meta and files of a container that is in memory */
+static int rmc_reader_parse(struct rmc_reader *reader, const char *data,
+			    size_t size)
+{
+	size_t off;
+	size_t start;
+
+	if (!uade_is_rmc(data, size)) {
+		z_log_error("%s is not an RMC file\n", reader->fname);
+		return -1;
+	}
+
+	reader->data = data;
+	reader->index = (struct rmc_view) {.size = 0};
+	off = RMC_PREFIX_LEN;
+	start = off;
+	if (view_skip(data, size, &off, 1))
+		goto invalid;
+	reader->meta = (struct rmc_view) {.data = data + start,
+					  .size = off - start};
+	start = off;
+	/* Items after files are ignored, except a valid file index */
+	if (rmc_reader_find_index(reader, data, size, start)) {
+		if (view_skip(data, size, &off, 1))
+			goto invalid;
+		reader->files = (struct rmc_view) {.data = data + start,
+						   .size = off - start};
+	}
+
+	if (!view_is_dict(&reader->meta) || !view_is_dict(&reader->files)) {
+		z_log_error("Either meta or files is not a dictionary: %s\n",
+			    reader->fname);
+		return -1;
+	}
+	return 0;
+
+invalid:
+	z_log_error("Invalid container format: %s\n", reader->fname);
+	return -1;
+}
+
+/*
+ * Map file fname for reading. A file shorter than minsize is rejected as
+ * not being what (e.g. "an RMC file"). Returns 0 on success.
+ */
+static int map_file(void **map, size_t *mapsize, const char *fname,
+		    size_t minsize, const char *what)
+{
+	struct stat st;
+	int fd;
+
+	*map = NULL;
+	fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		z_log_error("Can not open file %s (%s)\n", fname,
+			    strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		z_log_error("Can not stat %s (%s)\n", fname, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (st.st_size < (off_t) minsize) {
+		z_log_error("%s is not %s\n", fname, what);
+		close(fd);
+		return -1;
+	}
+	*mapsize = st.st_size;
+	*map = mmap(NULL, *mapsize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (*map == MAP_FAILED) {
+		*map = NULL;
+		z_log_error("Can not map %s (%s)\n", fname, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int rmc_reader_open(struct rmc_reader *reader, const char *fname)
+{
+	*reader = (struct rmc_reader) {.fname = fname};
+
+	if (map_file(&reader->map, &reader->mapsize, fname, RMC_PREFIX_LEN,
+		     "an RMC file"))
+		return -1;
+
+	if (rmc_reader_parse(reader, reader->map, reader->mapsize)) {
+		rmc_reader_close(reader);
+		return -1;
+	}
+	return 0;
+}
+
+/* Decode meta dictionary into a bencode object */
+static struct bencode *rmc_reader_get_meta(const struct rmc_reader *reader)
+{
+	struct bencode *meta = ben_decode(reader->meta.data, reader->meta.size);
+	if (meta == NULL)
+		z_log_error("Unable to decode meta: %s\n", reader->fname);
+	return meta;
+}
+
+/* Values of these keys are file names in the files dictionary */
+static int is_filename_key(const struct bencode *key)
+{
+	static const char *const names[] = {"file_hashes", "player", "song",
+					    "stored_files"};
+	size_t i;
+
+	for (i = 0; i < sizeof names / sizeof names[0]; i++) {
+		if (strcmp(ben_str_val(key), names[i]) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Replace strings that are not valid UTF-8 in meta. Such strings were
+ * written without conversion from Latin-1. File names are bytes, and they
+ * are kept as they are, so that they still refer to the files dictionary.
+ */
+static void normalize_meta_strings(struct bencode *b)
+{
+	struct bencode *key;
+	struct bencode *value;
+	struct bencode *str;
+	struct bencode *keys;
+	size_t pos;
+
+	if (ben_is_list(b)) {
+		ben_list_for_each(value, pos, b) {
+			if (!ben_is_str(value) ||
+			    is_valid_utf8(ben_str_val(value),
+					  ben_str_len(value))) {
+				normalize_meta_strings(value);
+				continue;
+			}
+			str = latin1_to_utf8(ben_str_val(value),
+					     ben_str_len(value));
+			if (str == NULL || ben_list_set(b, pos, str))
+				z_die("Can not set meta string\n");
+		}
+	} else if (ben_is_dict(b)) {
+		/* Keys are collected first, because setting may reorder b */
+		keys = ben_list();
+		if (keys == NULL)
+			z_die("No memory for meta keys\n");
+		ben_dict_for_each(key, value, pos, b) {
+			if (ben_is_str(key) && is_filename_key(key))
+				continue;
+			if (!ben_is_str(value) || !ben_is_str(key) ||
+			    is_valid_utf8(ben_str_val(value),
+					  ben_str_len(value))) {
+				normalize_meta_strings(value);
+				continue;
+			}
+			if (ben_list_append(keys, ben_clone(key)))
+				z_die("No memory for meta keys\n");
+		}
+		ben_list_for_each(key, pos, keys) {
+			value = ben_dict_get(b, key);
+			str = latin1_to_utf8(ben_str_val(value),
+					     ben_str_len(value));
+			if (str == NULL || ben_dict_set(b, ben_clone(key), str))
+				z_die("Can not set meta string\n");
+		}
+		ben_free(keys);
+	}
+}
+
+static int write_raw_files(FILE *f, const void *context)
+{
+	const struct rmc_view *files = context;
+	return xfwrite(files->data, 1, files->size, f) == files->size ? 0 : -1;
+}
+
+static void print_raw_files(FILE *f, const void *context)
+{
+	(void) context;
+	fprintf(f, "(unchanged)");
+}
+
+/*
+ * Repack an RMC file in place (--repack). The song is started once from
+ * the container to renormalize meta from the song info. With --repack=full
+ * the subsongs are simulated again for new play times. The files
+ * dictionary is copied as is from the old container.
+ */
+static int repack_file(struct worker *worker, struct uade_file *f)
+{
+	struct rmc_reader reader = {.fname = f->name};
+	struct bencode *container = NULL;
+	struct bencode *meta;
+	struct bencode *old;
+	const struct uade_song_info *info;
+	struct time_budget budget;
+	double batch_share;
+	struct files_writer files_writer = {.write = write_raw_files,
+					    .print_keys = print_raw_files,
+					    .context = &reader.files};
+	int sumtime;
+	int ret = -1;
+	double t;
+
+	if (rmc_reader_parse(&reader, f->data, f->size))
+		goto out;
+	meta = rmc_reader_get_meta(&reader);
+	if (meta == NULL)
+		goto out;
+	container = create_container();
+	if (ben_list_set(container, 1, meta))
+		z_die("Can not set meta for repacking\n");
+
+	worker_new_state(worker);
+	t = gettime();
+	ret = uade_play_from_buffer(f->name, f->data, f->size, -1,
+				    worker->state);
+	worker->stats.detect = gettime() - t;
+	if (ret <= 0) {
+		if (ret < 0) {
+			uade_cleanup_state(worker->state);
+			worker->state = NULL;
+		}
+		z_log_error("Can not play %s. Not repacking.\n", f->name);
+		ret = -1;
+		goto out;
+	}
+	info = uade_get_song_info(worker->state);
+
+	set_info(meta, worker->state);
+	normalize_meta_strings(meta);
+
+	if (repack_mode == REPACK_FULL) {
+		fprintf(worker->log, "Repacking %s (%d subsongs)\n", f->name,
+			info->subsongs.max - info->subsongs.min + 1);
+		old = ben_dict_pop_by_str(meta, "subsongs");
+		ben_free(old);
+		old = ben_dict_pop_by_str(meta, "estimated_subsongs");
+		ben_free(old);
+		if (ben_dict_set_by_str(meta, "subsongs", ben_dict()))
+			z_die("Can not reset subsongs\n");
+
+		worker->loop_saved_time = 0;
+		worker->simulated_time = 0;
+		time_budget_init(&budget,
+				 get_file_budget(worker->queue, &batch_share),
+				 info->subsongs.max - info->subsongs.min + 1);
+		sumtime = simulate_subsongs(
+			worker, f, container, info->subsongs.min,
+			info->subsongs.max,
+			info->subsongs.cur == info->subsongs.min, &budget);
+		use_batch_budget(batch_share, worker->simulated_time);
+		pthread_mutex_destroy(&budget.lock);
+		if (sumtime < 0) {
+			ret = -1;
+			goto out;
+		}
+	} else {
+		fprintf(worker->log, "Repacking meta of %s\n", f->name);
+	}
+
+	ret = write_container(f->name, container, &files_writer,
+			      &worker->stats);
+	worker->stats.result = ret == 0 ? "repacked" : "failed";
+
+out:
+	if (worker->state != NULL)
+		uade_stop(worker->state);
+	ben_free(container);
+	return ret != 0;
+}
+
+/* Meta is normally less than 4 KiB. Give up on absurdly large meta. */
+#define META_READ_SIZE 4096
+#define META_MAX_READ_SIZE (16 * 1024 * 1024)
+
+/*
+ * Read and decode only the meta dictionary of an RMC file. Reading stops
+ * at the end of meta, so the files dictionary is never read. Returns NULL
+ * if the file can not be read or it is not an RMC file. Errors are not
+ * printed if quiet is set.
+ */
+static struct bencode *read_meta(const char *fname, int quiet)
+{
+	size_t bufsize = META_READ_SIZE;
+	size_t len = 0;
+	size_t off;
+	char *buf = NULL;
+	char *newbuf;
+	struct bencode *meta = NULL;
+	ssize_t ret;
+	int eof = 0;
+	int fd = open(fname, O_RDONLY);
+
+	if (fd < 0) {
+		if (!quiet)
+			z_log_error("Can not open file %s (%s)\n", fname,
+				    strerror(errno));
+		return NULL;
+	}
+
+	while (1) {
+		newbuf = realloc(buf, bufsize);
+		if (newbuf == NULL)
+			z_die("No memory for reading meta\n");
+		buf = newbuf;
+		while (len < bufsize) {
+			ret = read(fd, buf + len, bufsize - len);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				if (!quiet)
+					z_log_error("Can not read %s (%s)\n",
+						    fname, strerror(errno));
+				goto out;
+			}
+			if (ret == 0) {
+				eof = 1;
+				break;
+			}
+			len += ret;
+		}
+
+		if (len < RMC_PREFIX_LEN || !uade_is_rmc(buf, len)) {
+			if (!quiet)
+				z_log_error("%s is not an RMC file\n", fname);
+			goto out;
+		}
+
+		off = RMC_PREFIX_LEN;
+		if (view_skip(buf, len, &off, 1) == 0)
+			break;
+
+		if (eof || bufsize >= META_MAX_READ_SIZE) {
+			if (!quiet)
+				z_log_error("Invalid meta: %s\n", fname);
+			goto out;
+		}
+		bufsize *= 2;
+	}
+
+	meta = ben_decode(buf + RMC_PREFIX_LEN, off - RMC_PREFIX_LEN);
+	if (meta == NULL || !ben_is_dict(meta)) {
+		if (!quiet)
+			z_log_error("Meta is not a dictionary: %s\n", fname);
+		ben_free(meta);
+		meta = NULL;
+	}
+
+out:
+	close(fd);
+	free(buf);
+	return meta;
+}
+
+static int show_meta_file(const char *fname, int quiet)
+{
+	char *metastring;
+	struct bencode *meta = read_meta(fname, quiet);
+	if (meta == NULL)
+		return -1;
+	metastring = ben_print(meta);
+	if (metastring == NULL)
+		z_die("Can not generate meta string\n");
+	printf("%s\t%s\n", fname, metastring);
+	free(metastring);
+	ben_free(meta);
+	return 0;
+}
+
+static void show_meta_walk_fn(const char *path, void *context)
+{
+	(void) context;
+	/* Files that are not RMC are skipped silently in directories */
+	show_meta_file(path, 1);
+}
+
+static int show_metadata(int i, int argc, char *argv[], char *_unused)
+{
+	int exitval = 0;
+	struct stat st;
+
+	(void) _unused;
+
+	for (; i < argc; i++) {
+		if (stat(argv[i], &st)) {
+			fprintf(stderr, "Can not stat %s. Skipping.\n",
+				argv[i]);
+			exitval = 1;
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			if (walk_tree(argv[i], show_meta_walk_fn, NULL))
+				z_die("Traversing directory %s failed\n",
+				      argv[i]);
+		} else if (show_meta_file(argv[i], 0)) {
+			exitval = 1;
+		}
+	}
+	return exitval;
+}
+
+/*
+ * Batched file I/O for pack and unpack. The files of a container are
+ * opened, read or written, and closed as a batch. With io_uring each step
+ * is submitted for a chunk of files at once. Without io_uring, or if the
+ * kernel does not allow it, the files are handled one by one.
+ */
+#define IO_BATCH_CHUNK 256
+#define IO_MAX_RETRIES 16
+
+struct io_op {
+	char *path;
+	char *data;
+	size_t size;
+	size_t done;
+	int fd;
+	int error;
+#ifdef HAVE_LIBURING
+	struct statx stx;
+	int retries;
+#endif
+};
+
+struct io_batch {
+	int writing;
+	struct io_op *ops;
+	size_t n;
+	size_t allocated;
+};
+
+static void io_batch_init(struct io_batch *batch, int writing)
+{
+	*batch = (struct io_batch) {.writing = writing};
+}
+
+/*
+ * Add a file to read, or data to write into a file. Written data is not
+ * copied, and it must stay valid until io_batch_run().
+ */
+static void io_batch_add(struct io_batch *batch, const char *path,
+			 const void *data, size_t size)
+{
+	struct io_op *ops;
+	struct io_op *op;
+
+	if (batch->n == batch->allocated) {
+		batch->allocated = batch->allocated ? 2 * batch->allocated : 16;
+		ops = realloc(batch->ops, batch->allocated * sizeof ops[0]);
+		if (ops == NULL)
+			z_die("No memory for I/O batch\n");
+		batch->ops = ops;
+	}
+	op = &batch->ops[batch->n++];
+	*op = (struct io_op) {.path = strdup(path), .data = (char *) data,
+			      .size = size, .fd = -1};
+	if (op->path == NULL)
+		z_die("No memory for I/O batch\n");
+}
+
+static void io_batch_free(struct io_batch *batch)
+{
+	size_t i;
+	for (i = 0; i < batch->n; i++) {
+		free(batch->ops[i].path);
+		if (!batch->writing)
+			free(batch->ops[i].data);
+	}
+	free(batch->ops);
+	*batch = (struct io_batch) {.writing = batch->writing};
+}
+
+static void io_op_alloc(struct io_op *op, size_t size)
+{
+	op->size = size;
+	op->data = malloc(size > 0 ? size : 1);
+	if (op->data == NULL)
+		z_die("No memory to read %s\n", op->path);
+}
+
+static void io_op_run_sync(struct io_op *op, int writing)
+{
+	struct stat st;
+	ssize_t ret;
+
+	if (writing)
+		op->fd = open(op->path, O_WRONLY | O_CREAT | O_TRUNC |
+			      O_CLOEXEC, 0666);
+	else
+		op->fd = open(op->path, O_RDONLY | O_CLOEXEC);
+	if (op->fd < 0) {
+		op->error = errno;
+		return;
+	}
+	if (!writing) {
+		if (fstat(op->fd, &st))
+			op->error = errno;
+		else
+			io_op_alloc(op, st.st_size);
+	}
+	while (op->error == 0 && op->done < op->size) {
+		if (writing)
+			ret = write(op->fd, op->data + op->done,
+				    op->size - op->done);
+		else
+			ret = read(op->fd, op->data + op->done,
+				   op->size - op->done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			op->error = ret < 0 ? errno : EIO;
+		else
+			op->done += ret;
+	}
+	if (close(op->fd) && op->error == 0)
+		op->error = errno;
+	op->fd = -1;
+}
+
+#ifdef HAVE_LIBURING
+enum io_step {
+	IO_OPEN,
+	IO_STAT,
+	IO_TRANSFER,
+	IO_CLOSE,
+};
+
+static int io_step_needed(const struct io_op *op, enum io_step step)
+{
+	switch (step) {
+	case IO_OPEN:
+		return 1;
+	case IO_STAT:
+		return op->error == 0 && op->fd >= 0;
+	case IO_TRANSFER:
+		return op->error == 0 && op->fd >= 0 && op->done < op->size;
+	case IO_CLOSE:
+		return op->fd >= 0;
+	}
+	return 0;
+}
+
+static void io_step_prep(struct io_uring_sqe *sqe, struct io_op *op,
+			 enum io_step step, int writing)
+{
+	size_t len = op->size - op->done;
+	if (len > (1 << 30))
+		len = 1 << 30;
+
+	switch (step) {
+	case IO_OPEN:
+		io_uring_prep_openat(sqe, AT_FDCWD, op->path, writing ?
+				     O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC :
+				     O_RDONLY | O_CLOEXEC, 0666);
+		break;
+	case IO_STAT:
+		io_uring_prep_statx(sqe, op->fd, "", AT_EMPTY_PATH, STATX_SIZE,
+				    &op->stx);
+		break;
+	case IO_TRANSFER:
+		if (writing)
+			io_uring_prep_write(sqe, op->fd, op->data + op->done,
+					    len, op->done);
+		else
+			io_uring_prep_read(sqe, op->fd, op->data + op->done,
+					   len, op->done);
+		break;
+	case IO_CLOSE:
+		io_uring_prep_close(sqe, op->fd);
+		break;
+	}
+	io_uring_sqe_set_data(sqe, op);
+}
+
+static void io_step_complete(struct io_op *op, enum io_step step, int res)
+{
+	switch (step) {
+	case IO_OPEN:
+		if (res < 0)
+			op->error = -res;
+		else
+			op->fd = res;
+		break;
+	case IO_STAT:
+		if (res < 0)
+			op->error = -res;
+		else
+			io_op_alloc(op, op->stx.stx_size);
+		break;
+	case IO_TRANSFER:
+		/* Retry interrupted transfers a limited number of times */
+		if ((res == -EINTR || res == -EAGAIN) &&
+		    ++op->retries <= IO_MAX_RETRIES)
+			break;
+		if (res <= 0) {
+			op->error = res < 0 ? -res : EIO;
+		} else {
+			op->done += res;
+			op->retries = 0;
+		}
+		break;
+	case IO_CLOSE:
+		if (res < 0 && op->error == 0)
+			op->error = -res;
+		op->fd = -1;
+		break;
+	}
+}
+
+/* Submit one step for every op that needs it, and wait for the results */
+static void io_uring_run_step(struct io_uring *ring, struct io_op *ops,
+			      size_t n, enum io_step step, int writing)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	size_t inflight = 0;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < n; i++) {
+		if (!io_step_needed(&ops[i], step))
+			continue;
+		sqe = io_uring_get_sqe(ring);
+		z_assert(sqe != NULL);
+		io_step_prep(sqe, &ops[i], step, writing);
+		inflight++;
+	}
+	while (inflight > 0) {
+		ret = io_uring_submit_and_wait(ring, 1);
+		if (ret < 0 && ret != -EINTR)
+			z_die("io_uring submission failed (%s)\n",
+			      strerror(-ret));
+		while (inflight > 0 && io_uring_peek_cqe(ring, &cqe) == 0) {
+			io_step_complete(io_uring_cqe_get_data(cqe), step,
+					 cqe->res);
+			io_uring_cqe_seen(ring, cqe);
+			inflight--;
+		}
+	}
+}
+
+static int io_transfer_pending(const struct io_op *ops, size_t n)
+{
+	size_t i;
+	for (i = 0; i < n; i++) {
+		if (io_step_needed(&ops[i], IO_TRANSFER))
+			return 1;
+	}
+	return 0;
+}
+
+/* Returns 0 on success, or -1 if io_uring is not available */
+static int io_batch_run_uring(struct io_batch *batch)
+{
+	struct io_uring ring;
+	struct io_op *ops;
+	size_t left;
+	size_t n;
+
+	if (io_uring_queue_init(IO_BATCH_CHUNK, &ring, 0))
+		return -1;
+
+	/* Chunks limit the number of open files */
+	for (left = batch->n; left > 0; left -= n) {
+		ops = batch->ops + (batch->n - left);
+		n = left < IO_BATCH_CHUNK ? left : IO_BATCH_CHUNK;
+		io_uring_run_step(&ring, ops, n, IO_OPEN, batch->writing);
+		if (!batch->writing)
+			io_uring_run_step(&ring, ops, n, IO_STAT, 0);
+		/* Short reads and writes are continued in the next round */
+		while (io_transfer_pending(ops, n))
+			io_uring_run_step(&ring, ops, n, IO_TRANSFER,
+					  batch->writing);
+		io_uring_run_step(&ring, ops, n, IO_CLOSE, batch->writing);
+	}
+
+	io_uring_queue_exit(&ring);
+	return 0;
+}
+#endif
+
+/*
+ * Read or write all files of the batch. Returns 0 on success, or -1 if
+ * some file failed. The errno value of each file is in ops[i].error.
+ */
+static int io_batch_run(struct io_batch *batch)
+{
+	size_t i;
+	int ret = 0;
+	int done = 0;
+
+#ifdef HAVE_LIBURING
+	if (use_io_uring && batch->n > 1)
+		done = io_batch_run_uring(batch) == 0;
+#endif
+	for (i = 0; i < batch->n; i++) {
+		if (!done)
+			io_op_run_sync(&batch->ops[i], batch->writing);
+		if (batch->ops[i].error)
+			ret = -1;
+	}
+	return ret;
+}
+
+/* Create directory path and its missing parents */
+static int make_dirs(const char *path)
+{
+	char dir[PATH_MAX];
+	char *p;
+
+	if (strlcpy(dir, path, sizeof dir) >= sizeof dir)
+		return -1;
+	for (p = dir + 1; *p != 0; p++) {
+		if (*p != '/')
+			continue;
+		*p = 0;
+		if (mkdir(dir, 0777) && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+	if (mkdir(dir, 0777) && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+static int unpack_meta(const char *dirname, const struct rmc_reader *reader)
+{
+	char metaname[PATH_MAX];
+	char *metastring = NULL;
+	struct bencode *meta = NULL;
+	FILE *f;
+	int ret = snprintf(metaname, sizeof metaname, "%s/meta", dirname);
+	z_assert(ret >= 0 && ((size_t) ret) < sizeof(metaname));
+
+	f = fopen(metaname, "wb");
+	if (f == NULL) {
+		z_log_error("Can not open meta file for writing: %s (%s)\n", metaname, strerror(errno));
+		goto err;
+	}
+
+	meta = rmc_reader_get_meta(reader);
+	if (meta == NULL)
+		goto err;
+
+	/* Stored files are unpacked as normal files */
+	if (store_dir != NULL)
+		ben_free(ben_dict_pop_by_str(meta, "stored_files"));
+
+	metastring = ben_print(meta);
+	if (metastring == NULL) {
+		z_log_error("Can not generate meta string\n");
+		goto err;
+	}
+
+	if (xfwrite(metastring, strlen(metastring), 1, f) != 1) {
+		z_log_error("Write error to meta file %s (%s)\n",
+			    metaname, strerror(errno));
+		goto err;
+	}
+
+	free(metastring);
+	ben_free(meta);
+	fclose(f);
+	return 0;
+
+err:
+	if (f != NULL)
+		fclose(f);
+	free(metastring);
+	ben_free(meta);
+	return -1;
+
+}
+
+/*
+ * Create the directories of files and add the files to batch. The batch
+ * refers to the file contents in the container.
+ */
+static int scan_and_write_files(const struct rmc_view *files,
+				const char *oldprefix, struct io_batch *batch)
+{
+	struct rmc_dict_iter iter;
+	struct rmc_view key;
+	struct rmc_view value;
+	struct rmc_view content;
+	char name[PATH_MAX];
+	char prefix[PATH_MAX];
+	int ret;
+
+	rmc_dict_iter_init(&iter, files);
+	while ((ret = rmc_dict_next(&iter, &key, &value)) > 0) {
+		if (view_to_cstr(name, sizeof name, &key)) {
+			z_log_error("Invalid file name\n");
+			return 1;
+		}
+		if (strcmp(name, "..") == 0 ||
+		    strcmp(name, ".") == 0 ||
+		    strstr(name, "/") != NULL) {
+			z_log_error("Invalid name: %s\n", name);
+			return 1;
+		}
+
+		if (view_is_dict(&value)) {
+			snprintf(prefix, sizeof prefix, "%s%s/", oldprefix,
+				 name);
+			if (mkdir(prefix, 0700)) {
+				z_log_error("Unable to create directory "
+					    "%s (%s)\n",
+					    prefix, strerror(errno));
+				return 1;
+			}
+			if (scan_and_write_files(&value, prefix, batch))
+				return 1;
+			continue;
+		}
+
+		if (view_get_str(&content, &value)) {
+			z_log_error("Invalid file content: %s\n", name);
+			return 1;
+		}
+		snprintf(prefix, sizeof prefix, "%s%s", oldprefix, name);
+		io_batch_add(batch, prefix, content.data, content.size);
+	}
+	if (ret < 0) {
+		z_log_error("Invalid files dictionary\n");
+		return 1;
+	}
+	return 0;
+}
+
+static int unpack_files(const char *dirname, const struct rmc_reader *reader)
+{
+	char prefix[PATH_MAX];
+	struct io_batch batch;
+	size_t i;
+	int ret;
+
+	/* Note, trailing / is important in prefix string */
+	ret = snprintf(prefix, sizeof prefix, "%s/files/", dirname);
+	z_assert(ret >= 0 && ((size_t) ret) < sizeof(prefix));
+
+	if (mkdir(prefix, 0700)) {
+		if (errno != EEXIST) {
+			z_log_error("Unable to create directory %s (%s)\n",
+				    prefix, strerror(errno));
+			return -1;
+		}
+	}
+	io_batch_init(&batch, 1);
+	ret = scan_and_write_files(&reader->files, prefix, &batch);
+	if (ret == 0 && io_batch_run(&batch)) {
+		for (i = 0; i < batch.n; i++) {
+			if (batch.ops[i].error == 0)
+				continue;
+			z_log_error("Unable to write to file: %s (%s)\n",
+				    batch.ops[i].path,
+				    strerror(batch.ops[i].error));
+		}
+		ret = 1;
+	}
+	io_batch_free(&batch);
+	if (ret) {
+		z_log_error("Can not unpack RMC to %s\n", dirname);
+		return -1;
+	}
+	return 0;
+}
+
+/* Each path component must be a valid file name */
+static int is_valid_entry_name(const char *name)
+{
+	const char *p;
+	size_t len;
+
+	for (p = name; ; p += len + 1) {
+		len = strcspn(p, "/");
+		if (len == 0 || (len == 1 && p[0] == '.') ||
+		    (len == 2 && p[0] == '.' && p[1] == '.'))
+			return 0;
+		if (p[len] == 0)
+			return 1;
+	}
+}
+
+/* Write data to dirname/files/name, creating the directories */
+static int write_entry_file(const char *dirname, const char *name,
+			    const void *data, size_t size)
+{
+	struct io_batch batch;
+	char path[PATH_MAX];
+	char dname[PATH_MAX];
+	int ret;
+
+	ret = snprintf(path, sizeof path, "%s/files/%s", dirname, name);
+	if (ret < 0 || ((size_t) ret) >= sizeof path) {
+		z_log_error("Too long path: %s/files/%s\n", dirname, name);
+		return -1;
+	}
+	xdirname(dname, sizeof dname, path);
+	if (make_dirs(dname)) {
+		z_log_error("Can not create directory %s (%s)\n", dname,
+			    strerror(errno));
+		return -1;
+	}
+	io_batch_init(&batch, 1);
+	io_batch_add(&batch, path, data, size);
+	ret = io_batch_run(&batch);
+	if (ret)
+		z_log_error("Unable to write to file: %s (%s)\n", path,
+			    strerror(batch.ops[0].error));
+	io_batch_free(&batch);
+	return ret;
+}
+
+/*
+ * Unpack one file of the container (--entry) to dirname/files/name. With
+ * a file index, only the index and the file contents are read. Files
+ * moved to a shared store are read from --store.
+ */
+static int unpack_entry_file(const char *dirname,
+			     const struct rmc_reader *reader, const char *name)
+{
+	struct rmc_view content;
+	struct bencode *meta;
+	void *data = NULL;
+	size_t size;
+	int ret;
+
+	if (!is_valid_entry_name(name)) {
+		z_log_error("Invalid entry name: %s\n", name);
+		return -1;
+	}
+
+	ret = rmc_reader_find_file(&content, reader, name);
+	if (ret < 0) {
+		z_log_error("Invalid container format: %s\n", reader->fname);
+		return -1;
+	}
+	if (ret > 0)
+		return write_entry_file(dirname, name, content.data,
+					content.size);
+
+	if (store_dir != NULL) {
+		meta = rmc_reader_get_meta(reader);
+		if (meta != NULL)
+			data = read_stored_file(&size, meta, name);
+		ben_free(meta);
+	}
+	if (data == NULL) {
+		z_log_error("No file %s in %s\n", name, reader->fname);
+		return -1;
+	}
+	ret = write_entry_file(dirname, name, data, size);
+	free(data);
+	return ret;
+}
+
+/* Restore files that were moved to the shared store (--store) */
+static int unpack_stored_files(const char *dirname,
+			       const struct rmc_reader *reader)
+{
+	struct bencode *meta = rmc_reader_get_meta(reader);
+	struct bencode *stored;
+	struct bencode *str;
+	void *data;
+	size_t size;
+	size_t pos;
+	int ret = 0;
+
+	if (meta == NULL)
+		return -1;
+	stored = ben_dict_get_by_str(meta, "stored_files");
+	if (stored == NULL || !ben_is_list(stored))
+		goto out;
+	if (store_dir == NULL) {
+		z_log_warning("%s has files in a shared store. Use --store "
+			      "to unpack them.\n", reader->fname);
+		goto out;
+	}
+	ben_list_for_each(str, pos, stored) {
+		if (!ben_is_str(str) || !is_valid_entry_name(ben_str_val(str))) {
+			z_log_error("Invalid stored file name in %s\n",
+				    reader->fname);
+			ret = -1;
+			break;
+		}
+		data = read_stored_file(&size, meta, ben_str_val(str));
+		if (data == NULL) {
+			ret = -1;
+			break;
+		}
+		ret = write_entry_file(dirname, ben_str_val(str), data, size);
+		free(data);
+		if (ret)
+			break;
+	}
+out:
+	ben_free(meta);
+	return ret;
+}
+
+static int unpack_file(const char *dir, const char *fname)
+{
+	struct rmc_reader reader;
+
+	if (rmc_reader_open(&reader, fname))
+		return 1;
+
+	if (unpack_entry != NULL) {
+		if (unpack_entry_file(dir, &reader, unpack_entry))
+			goto cleanup;
+		rmc_reader_close(&reader);
+		fprintf(stderr, "Unpacked %s of %s to directory %s (OK)\n",
+			unpack_entry, fname, dir);
+		return 0;
+	}
+
+	madvise(reader.map, reader.mapsize, MADV_SEQUENTIAL);
+
+	if (unpack_meta(dir, &reader))
+		goto cleanup;
+
+	if (unpack_files(dir, &reader))
+		goto cleanup;
+
+	if (unpack_stored_files(dir, &reader))
+		goto cleanup;
+
+	rmc_reader_close(&reader);
+	fprintf(stderr, "Unpacked %s to directory %s (OK)\n", fname, dir);
+	return 0;
+
+cleanup:
+	rmc_reader_close(&reader);
+	return 1;
+}
+
+/*
+ * Pack (-p). The files directory is scanned into a tree of entries sorted
+ * in bencode key order. All files are read once into the buffers of an
+ * I/O batch, and the files dictionary is streamed from those buffers.
+ */
+struct pack_entry {
+	char *name;
+	/* Index of the file in the I/O batch, or -1 for a directory */
+	ssize_t op;
+	struct pack_entry *entries;
+	size_t n;
+};
+
+struct pack_tree {
+	struct pack_entry root;
+	struct io_batch batch;
+};
+
+static int compare_pack_entries(const void *a, const void *b)
+{
+	const struct pack_entry *x = a;
+	const struct pack_entry *y = b;
+	return strcmp(x->name, y->name);
+}
+
+static void free_pack_entry(struct pack_entry *entry)
+{
+	size_t i;
+	for (i = 0; i < entry->n; i++)
+		free_pack_entry(&entry->entries[i]);
+	free(entry->entries);
+	free(entry->name);
+}
+
+static int scan_pack_dir(struct pack_tree *tree, struct pack_entry *dir,
+			 const char *dirname, int depth)
+{
+	char path[PATH_MAX];
+	struct pack_entry *entries;
+	struct pack_entry *entry;
+	struct dirent *de;
+	struct stat st;
+	size_t allocated = 0;
+	int ret = 0;
+	DIR *d;
+
+	if (depth > RMC_MAX_DEPTH) {
+		z_log_error("Too deep directory: %s\n", dirname);
+		return -1;
+	}
+	d = opendir(dirname);
+	if (d == NULL) {
+		z_log_error("Can not open directory %s (%s)\n", dirname,
+			    strerror(errno));
+		return -1;
+	}
+	while (ret == 0 && (de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0)
+			continue;
+		z_snprintf_or_die(path, sizeof(path), "%s/%s", dirname,
+				  de->d_name);
+		if (stat(path, &st)) {
+			z_log_error("Can not stat %s (%s)\n", path,
+				    strerror(errno));
+			ret = -1;
+			break;
+		}
+		if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+			z_log_warning("Skipping special file %s\n", path);
+			continue;
+		}
+		if (dir->n == allocated) {
+			allocated = allocated ? 2 * allocated : 16;
+			entries = realloc(dir->entries,
+					  allocated * sizeof entries[0]);
+			if (entries == NULL)
+				z_die("No memory for pack entries\n");
+			dir->entries = entries;
+		}
+		entry = &dir->entries[dir->n++];
+		*entry = (struct pack_entry) {.name = strdup(de->d_name),
+					      .op = -1};
+		if (entry->name == NULL)
+			z_die("No memory for pack entries\n");
+		if (S_ISDIR(st.st_mode)) {
+			ret = scan_pack_dir(tree, entry, path, depth + 1);
+		} else {
+			entry->op = tree->batch.n;
+			io_batch_add(&tree->batch, path, NULL, 0);
+		}
+	}
+	closedir(d);
+	qsort(dir->entries, dir->n, sizeof dir->entries[0],
+	      compare_pack_entries);
+	return ret;
+}
+
+static int write_pack_entry(FILE *f, const struct pack_tree *tree,
+			    const struct pack_entry *dir)
+{
+	const struct pack_entry *entry;
+	const struct io_op *op;
+	size_t i;
+
+	if (fputc('d', f) == EOF)
+		return -1;
+	for (i = 0; i < dir->n; i++) {
+		entry = &dir->entries[i];
+		if (stream_str(f, entry->name, strlen(entry->name)))
+			return -1;
+		if (entry->op < 0) {
+			if (write_pack_entry(f, tree, entry))
+				return -1;
+			continue;
+		}
+		op = &tree->batch.ops[entry->op];
+		if (stream_str(f, op->data, op->size))
+			return -1;
+	}
+	return fputc('e', f) == EOF ? -1 : 0;
+}
+
+static int write_pack_tree(FILE *f, const void *context)
+{
+	const struct pack_tree *tree = context;
+	return write_pack_entry(f, tree, &tree->root);
+}
+
+static void print_pack_entry(FILE *f, const struct pack_entry *dir,
+			     const char *oldprefix)
+{
+	char prefix[PATH_MAX];
+	size_t i;
+
+	for (i = 0; i < dir->n; i++) {
+		if (dir->entries[i].op < 0) {
+			snprintf(prefix, sizeof prefix, "%s%s/", oldprefix,
+				 dir->entries[i].name);
+			print_pack_entry(f, &dir->entries[i], prefix);
+		} else {
+			fprintf(f, "%s%s ", oldprefix, dir->entries[i].name);
+		}
+	}
+}
+
+static void print_pack_tree(FILE *f, const void *context)
+{
+	const struct pack_tree *tree = context;
+	print_pack_entry(f, &tree->root, "");
+}
+
+static int pack_container(int i, int argc, char *argv[], char *pack_dir)
+{
+	struct bencode *container = create_container();
+	struct bencode *meta;
+	char *targetname;
+	char files_dir[PATH_MAX];
+	char path[PATH_MAX];
+	void *metabytes;
+	size_t size;
+	struct pack_tree tree = {.root = {.op = -1}};
+	struct files_writer files_writer = {.write = write_pack_tree,
+					    .print_keys = print_pack_tree,
+					    .context = &tree};
+	size_t j;
+	int ret;
+
+	z_assert(container != NULL);
+
+	if ((i + 1) != argc) {
+		z_log_fatal("Expect rmc name as the only non-option "
+			    "argument\n");
+	}
+	targetname = argv[i];
+	z_assert(targetname != NULL);
+
+	z_snprintf_or_die(path, sizeof(path), "%s/meta", pack_dir);
+	metabytes = z_file_read(&size, path);
+	z_assert(metabytes != NULL);
+
+	meta = ben_decode_printed(metabytes, size);
+	z_assert(meta != NULL);
+	/* An edited meta file may have Latin-1 strings */
+	normalize_meta_strings(meta);
+	ben_list_set(container, 1, meta);
+	free(metabytes);
+
+	z_snprintf_or_die(files_dir, sizeof(files_dir), "%s/files", pack_dir);
+	io_batch_init(&tree.batch, 0);
+	if (scan_pack_dir(&tree, &tree.root, files_dir, 0))
+		z_die("Can not scan %s\n", files_dir);
+	io_batch_run(&tree.batch);
+	for (j = 0; j < tree.batch.n; j++) {
+		if (tree.batch.ops[j].error)
+			z_die("Can not read %s (%s)\n", tree.batch.ops[j].path,
+			      strerror(tree.batch.ops[j].error));
+	}
+
+	ret = write_container(targetname, container, &files_writer, NULL);
+
+	free_pack_entry(&tree.root);
+	io_batch_free(&tree.batch);
+	ben_free(container);
+	return ret;
+}
+
+/* Called with the path of an RMC file and its name, see walk_rmc_files() */
+typedef void (*rmc_file_fn)(const char *path, const char *name,
+			    void *context);
+
+struct rmc_walk {
+	rmc_file_fn fn;
+	void *context;
+	size_t rootlen;
+};
+
+static void rmc_walk_fn(const char *path, void *context)
+{
+	struct rmc_walk *walk = context;
+
+	/* Other files are skipped silently in directories */
+	if (!has_rmc_suffix(path))
+		return;
+	walk->fn(path, path + walk->rootlen + 1, walk->context);
+}
+
+/*
+ * Call fn for the RMC files of paths argv[i..argc-1]. Files in directories
+ * are named by their path relative to the directory, and other files by
+ * their base name. Returns -1 if a path can not be found.
+ */
+static int walk_rmc_files(int i, int argc, char *argv[], rmc_file_fn fn,
+			  void *context)
+{
+	char bname[PATH_MAX];
+	struct rmc_walk walk = {.fn = fn, .context = context};
+	struct stat st;
+	int ret = 0;
+
+	for (; i < argc; i++) {
+		if (stat(argv[i], &st)) {
+			z_log_error("Can not stat %s (%s)\n", argv[i],
+				    strerror(errno));
+			ret = -1;
+			continue;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			walk.rootlen = strlen(argv[i]);
+			while (walk.rootlen > 1 &&
+			       argv[i][walk.rootlen - 1] == '/')
+				walk.rootlen--;
+			if (walk_tree(argv[i], rmc_walk_fn, &walk))
+				z_die("Traversing directory %s failed\n",
+				      argv[i]);
+		} else {
+			xbasename(bname, sizeof bname, argv[i]);
+			fn(argv[i], bname, context);
+		}
+	}
+	return ret;
+}
+
+/* Hash set of paths with open addressing */
+struct path_set {
+	char **slots;
+	size_t mask;
+	size_t n;
+};
+
+static size_t path_set_slot(const struct path_set *set, const char *path,
+			    size_t len)
+{
+	struct rmc_hash hash;
+	size_t slot;
+
+	rmc_hash(&hash, path, len, 0);
+	for (slot = hash.h[0] & set->mask; set->slots[slot] != NULL;
+	     slot = (slot + 1) & set->mask) {
+		if (strncmp(set->slots[slot], path, len) == 0 &&
+		    set->slots[slot][len] == 0)
+			break;
+	}
+	return slot;
+}
+
+/* Returns 1 if the first len bytes of path are in the set */
+static int path_set_has(const struct path_set *set, const char *path,
+			size_t len)
+{
+	if (set->slots == NULL)
+		return 0;
+	return set->slots[path_set_slot(set, path, len)] != NULL;
+}
+
+static void path_set_add(struct path_set *set, const char *path, size_t len)
+{
+	char **oldslots = set->slots;
+	size_t oldsize = oldslots != NULL ? set->mask + 1 : 0;
+	size_t slot;
+	size_t i;
+
+	/* Keep the table at most half full */
+	if (2 * (set->n + 1) > oldsize) {
+		set->slots = calloc(oldsize > 0 ? 2 * oldsize : 256,
+				    sizeof set->slots[0]);
+		if (set->slots == NULL)
+			z_die("No memory for path set\n");
+		set->mask = (oldsize > 0 ? 2 * oldsize : 256) - 1;
+		for (i = 0; i < oldsize; i++) {
+			if (oldslots[i] == NULL)
+				continue;
+			set->slots[path_set_slot(set, oldslots[i],
+						 strlen(oldslots[i]))] =
+				oldslots[i];
+		}
+		free(oldslots);
+	}
+	slot = path_set_slot(set, path, len);
+	if (set->slots[slot] != NULL)
+		return;
+	set->slots[slot] = strndup(path, len);
+	if (set->slots[slot] == NULL)
+		z_die("No memory for path set\n");
+	set->n++;
+}
+
+static void path_set_free(struct path_set *set)
+{
+	size_t i;
+
+	for (i = 0; set->slots != NULL && i <= set->mask; i++)
+		free(set->slots[i]);
+	free(set->slots);
+	*set = (struct path_set) {0};
+}
+
+/*
+ * Recursive unpacking (-r -u dir). Each RMC file is unpacked to its own
+ * directory under dir. The directory has the path of the RMC file
+ * relative to the scanned directory, without the .rmc suffix.
+ */
+struct unpack_job {
+	char *src;
+	char *dst;
+};
+
+struct unpack_scan {
+	const char *unpack_dir;
+	struct work_queue *queue;
+	/* Output directories of queued jobs, and their parent directories */
+	struct path_set dsts;
+	struct path_set parents;
+	int exitval;
+};
+
+/*
+ * Returns 1 if dst is the output directory of a queued job, is inside one,
+ * or contains one. Otherwise dst is recorded for the following checks.
+ */
+static int unpack_dst_collides(struct unpack_scan *scan, const char *dst)
+{
+	size_t start = strlen(scan->unpack_dir) + 1;
+	size_t len = strlen(dst);
+	size_t i;
+
+	if (path_set_has(&scan->dsts, dst, len) ||
+	    path_set_has(&scan->parents, dst, len))
+		return 1;
+	for (i = start; i < len; i++) {
+		if (dst[i] == '/' && path_set_has(&scan->dsts, dst, i))
+			return 1;
+	}
+	path_set_add(&scan->dsts, dst, len);
+	for (i = start; i < len; i++) {
+		if (dst[i] == '/')
+			path_set_add(&scan->parents, dst, i);
+	}
+	return 0;
+}
+
+struct unpack_worker {
+	struct work_queue *queue;
+	int exitval;
+	pthread_t thread;
+};
+
+static void add_unpack_job(const char *src, const char *relname,
+			   void *context)
+{
+	struct unpack_scan *scan = context;
+	struct unpack_job *job;
+	char dst[PATH_MAX];
+	size_t len;
+	int ret;
+
+	ret = snprintf(dst, sizeof dst, "%s/%s", scan->unpack_dir, relname);
+	if (ret < 0 || ((size_t) ret) >= sizeof dst) {
+		z_log_warning("Unpack path too long for %s. Skipping.\n", src);
+		return;
+	}
+	len = ret;
+	if (has_rmc_suffix(dst))
+		dst[len - 4] = 0;
+
+	/* Parallel jobs would mix their files in one directory */
+	if (unpack_dst_collides(scan, dst)) {
+		z_log_error("%s would be unpacked into the directory of another "
+			    "container: %s. Skipping.\n", src, dst);
+		scan->exitval = 1;
+		return;
+	}
+
+	job = malloc(sizeof *job);
+	if (job == NULL)
+		z_die("No memory for unpack job\n");
+	job->src = strdup(src);
+	job->dst = strdup(dst);
+	if (job->src == NULL || job->dst == NULL)
+		z_die("No memory for unpack job\n");
+	work_queue_add(scan->queue, job);
+}
+
+static void *unpack_worker_fn(void *arg)
+{
+	struct unpack_worker *worker = arg;
+	struct unpack_job *job;
+
+	while ((job = work_queue_pop(worker->queue)) != NULL) {
+		if (make_dirs(job->dst)) {
+			z_log_error("Can not create directory %s (%s)\n",
+				    job->dst, strerror(errno));
+			worker->exitval = 1;
+		} else if (unpack_file(job->dst, job->src)) {
+			worker->exitval = 1;
+		}
+		free(job->src);
+		free(job->dst);
+		free(job);
+	}
+	return NULL;
+}
+
+static int unpack_recursively(int i, int argc, char *argv[],
+			      char *unpack_dir)
+{
+	struct work_queue queue;
+	struct unpack_scan scan = {.unpack_dir = unpack_dir,
+				   .queue = &queue};
+	struct unpack_worker *workers;
+	int exitval = 0;
+	int j;
+
+	work_queue_init(&queue, 1);
+
+	workers = calloc(njobs, sizeof workers[0]);
+	if (workers == NULL)
+		z_die("No memory for %d workers\n", njobs);
+	for (j = 0; j < njobs; j++) {
+		workers[j].queue = &queue;
+		if (pthread_create(&workers[j].thread, NULL, unpack_worker_fn,
+				   &workers[j]))
+			z_die("Can not create worker thread %d\n", j);
+	}
+
+	if (walk_rmc_files(i, argc, argv, add_unpack_job, &scan))
+		exitval = 1;
+	work_queue_finish(&queue);
+
+	for (j = 0; j < njobs; j++) {
+		pthread_join(workers[j].thread, NULL);
+		exitval |= workers[j].exitval;
+	}
+	free(workers);
+	work_queue_free(&queue);
+	path_set_free(&scan.dsts);
+	path_set_free(&scan.parents);
+	return exitval | scan.exitval;
+}
+
+static int unpack_container(int i, int argc, char *argv[], char *unpack_dir)
+{
+	int exitval = 0;
+
+	if (recursive_mode)
+		return unpack_recursively(i, argc, argv, unpack_dir);
+
+	if ((i + 1) != argc) {
+		z_log_fatal("Expect rmc name as the only non-option "
+			    "argument\n");
+	}
+
+	if (unpack_file(unpack_dir, argv[i]))
+		exitval = 1;
+
+	return exitval;
+}
+
+/*
+ * Bundles (--bundle-*) store many RMC containers in one file. The
+ * containers are stored as they are, followed by an index that is read
+ * with mmap. See doc/rmc-bundle-format.
+ */
+#define BUNDLE_MAGIC "RMCBNDL1"
+#define BUNDLE_INDEX_MAGIC "RMCBIDX1"
+#define BUNDLE_MAGIC_LEN 8
+#define BUNDLE_RECORD_SIZE 32
+#define BUNDLE_FOOTER_SIZE 32
+
+struct rmc_bundle {
+	const char *fname;
+	void *map;
+	size_t mapsize;
+	/* Index records sorted by name, and the string pool */
+	const uint8_t *records;
+	size_t n;
+	const char *pool;
+	size_t poolsize;
+	/* Containers end where the index begins */
+	uint64_t index_offset;
+};
+
+/* An entry of a bundle. The views point into the mapped bundle. */
+struct rmc_bundle_entry {
+	struct rmc_view name;
+	struct rmc_view container;
+	struct rmc_view meta;
+};
+
+static void rmc_bundle_close(struct rmc_bundle *bundle)
+{
+	if (bundle->map != NULL)
+		munmap(bundle->map, bundle->mapsize);
+	*bundle = (struct rmc_bundle) {.map = NULL};
+}
+
+/* Returns 0 on success, or -1 if the index entry i is invalid */
+static int rmc_bundle_get(const struct rmc_bundle *bundle, size_t i,
+			  struct rmc_bundle_entry *entry)
+{
+	const uint8_t *record = bundle->records + i * BUNDLE_RECORD_SIZE;
+	const char *data = bundle->map;
+	uint64_t offset;
+	uint64_t length;
+	uint32_t name;
+	uint32_t namelen;
+	uint32_t meta;
+	uint32_t metalen;
+
+	if (i >= bundle->n)
+		return -1;
+	offset = load_le64(record);
+	length = load_le64(record + 8);
+	name = load_le32(record + 16);
+	namelen = load_le32(record + 20);
+	meta = load_le32(record + 24);
+	metalen = load_le32(record + 28);
+	if (offset < BUNDLE_MAGIC_LEN ||
+	    offset > bundle->index_offset ||
+	    length > bundle->index_offset - offset ||
+	    name > bundle->poolsize || namelen > bundle->poolsize - name ||
+	    meta > bundle->poolsize || metalen > bundle->poolsize - meta)
+		return -1;
+
+	*entry = (struct rmc_bundle_entry) {
+		.name = {.data = bundle->pool + name, .size = namelen},
+		.container = {.data = data + offset, .size = length},
+		.meta = {.data = bundle->pool + meta, .size = metalen}};
+	return 0;
+}
+
+/*
+ * Compare names bytewise. A name that is a prefix of the other is the
+ * smaller one. Bundles and indexes are sorted in this order.
+ */
+static int compare_names(const char *x, size_t xlen, const char *y,
+			 size_t ylen)
+{
+	int ret = memcmp(x, y, xlen < ylen ? xlen : ylen);
+	if (ret != 0)
+		return ret;
+	return (xlen > ylen) - (xlen < ylen);
+}
+
+static int compare_view_to_str(const struct rmc_view *view, const char *s)
+{
+	return compare_names(view->data, view->size, s, strlen(s));
+}
+
+/* Find a container by name. Returns 0 on success, or -1 if not found. */
+static int rmc_bundle_find(const struct rmc_bundle *bundle, const char *name,
+			   struct rmc_bundle_entry *entry)
+{
+	size_t low = 0;
+	size_t high = bundle->n;
+	size_t mid;
+	int ret;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (rmc_bundle_get(bundle, mid, entry))
+			return -1;
+		ret = compare_view_to_str(&entry->name, name);
+		if (ret == 0)
+			return 0;
+		if (ret < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return -1;
+}
+
+static int rmc_bundle_open(struct rmc_bundle *bundle, const char *fname)
+{
+	const uint8_t *footer;
+	uint64_t count;
+	uint64_t poolsize;
+
+	*bundle = (struct rmc_bundle) {.fname = fname};
+
+	if (map_file(&bundle->map, &bundle->mapsize, fname,
+		     BUNDLE_MAGIC_LEN + BUNDLE_FOOTER_SIZE, "a bundle"))
+		return -1;
+
+	footer = (const uint8_t *) bundle->map + bundle->mapsize -
+		BUNDLE_FOOTER_SIZE;
+	if (memcmp(bundle->map, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN) ||
+	    memcmp(footer + 24, BUNDLE_INDEX_MAGIC, BUNDLE_MAGIC_LEN)) {
+		z_log_error("%s is not a bundle\n", fname);
+		goto err;
+	}
+	bundle->index_offset = load_le64(footer);
+	count = load_le64(footer + 8);
+	poolsize = load_le64(footer + 16);
+	if (bundle->index_offset < BUNDLE_MAGIC_LEN ||
+	    bundle->index_offset > bundle->mapsize - BUNDLE_FOOTER_SIZE ||
+	    count > (bundle->mapsize - BUNDLE_FOOTER_SIZE -
+		     bundle->index_offset) / BUNDLE_RECORD_SIZE ||
+	    /* The pool fills the rest. Subtract so that nothing overflows. */
+	    poolsize != bundle->mapsize - BUNDLE_FOOTER_SIZE -
+	    bundle->index_offset - count * BUNDLE_RECORD_SIZE) {
+		z_log_error("Invalid bundle index: %s\n", fname);
+		goto err;
+	}
+	bundle->n = count;
+	bundle->records = (const uint8_t *) bundle->map + bundle->index_offset;
+	bundle->pool = (const char *) bundle->records +
+		count * BUNDLE_RECORD_SIZE;
+	bundle->poolsize = poolsize;
+	return 0;
+
+err:
+	rmc_bundle_close(bundle);
+	return -1;
+}
+
+/*
+ * Bundle writer. Containers are appended to the file, and the index is
+ * collected in memory and written by bundle_writer_finish().
+ */
+struct bundle_item {
+	uint64_t offset;
+	uint64_t length;
+	size_t name;
+	size_t namelen;
+	size_t meta;
+	size_t metalen;
+	/* Set after the pool is complete, for sorting */
+	const char *namestr;
+};
+
+/* Strings of an index that are referred to with 32-bit offsets */
+struct string_pool {
+	char *data;
+	size_t size;
+	size_t allocated;
+};
+
+static uint32_t string_pool_add(struct string_pool *pool, const void *data,
+				size_t len)
+{
+	size_t pos = pool->size;
+	char *newdata;
+	if (len > UINT32_MAX || pool->size + len > UINT32_MAX)
+		z_die("Index is too large\n");
+	if (pool->size + len > pool->allocated) {
+		pool->allocated = 2 * (pool->size + len);
+		newdata = realloc(pool->data, pool->allocated);
+		if (newdata == NULL)
+			z_die("No memory for index\n");
+		pool->data = newdata;
+	}
+	/* data may be NULL for an empty string */
+	if (len > 0)
+		memcpy(pool->data + pos, data, len);
+	pool->size += len;
+	return pos;
+}
+
+struct bundle_writer {
+	FILE *f;
+	uint64_t offset;
+	struct bundle_item *items;
+	size_t n;
+	size_t allocated;
+	struct string_pool pool;
+};
+
+static void bundle_writer_add_item(struct bundle_writer *writer,
+				   uint64_t offset, uint64_t length,
+				   const struct rmc_view *name,
+				   const struct rmc_view *meta)
+{
+	struct bundle_item *items;
+	if (writer->n == writer->allocated) {
+		writer->allocated = writer->allocated ?
+			2 * writer->allocated : 64;
+		items = realloc(writer->items,
+				writer->allocated * sizeof items[0]);
+		if (items == NULL)
+			z_die("No memory for bundle index\n");
+		writer->items = items;
+	}
+	writer->items[writer->n++] = (struct bundle_item) {
+		.offset = offset, .length = length,
+		.name = string_pool_add(&writer->pool, name->data, name->size),
+		.namelen = name->size,
+		.meta = string_pool_add(&writer->pool, meta->data, meta->size),
+		.metalen = meta->size};
+}
+
+/* Append container data with the given name to the bundle */
+static int bundle_writer_add(struct bundle_writer *writer, const char *name,
+			     const void *data, size_t size)
+{
+	struct rmc_reader reader = {.fname = name};
+	struct rmc_view nameview = {.data = name, .size = strlen(name)};
+
+	if (rmc_reader_parse(&reader, data, size))
+		return -1;
+	if (xfwrite(data, 1, size, writer->f) != size) {
+		z_log_error("Can not write %s into bundle (%s)\n", name,
+			    strerror(errno));
+		return -1;
+	}
+	bundle_writer_add_item(writer, writer->offset, size, &nameview,
+			       &reader.meta);
+	writer->offset += size;
+	return 0;
+}
+
+static int compare_bundle_names(const struct bundle_item *x,
+				const struct bundle_item *y)
+{
+	return compare_names(x->namestr, x->namelen, y->namestr, y->namelen);
+}
+
+static int compare_bundle_items(const void *a, const void *b)
+{
+	const struct bundle_item *x = a;
+	const struct bundle_item *y = b;
+	int ret = compare_bundle_names(x, y);
+	if (ret != 0)
+		return ret;
+	return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+/*
+ * Write the index and the footer at the current position. If a name is in
+ * the bundle twice, the first container is kept and -1 is returned, but
+ * the index is still valid.
+ */
+static int bundle_writer_finish(struct bundle_writer *writer)
+{
+	uint8_t record[BUNDLE_RECORD_SIZE];
+	uint8_t footer[BUNDLE_FOOTER_SIZE];
+	struct bundle_item *item;
+	size_t n = 0;
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < writer->n; i++)
+		writer->items[i].namestr = writer->pool.data +
+			writer->items[i].name;
+	qsort(writer->items, writer->n, sizeof writer->items[0],
+	      compare_bundle_items);
+
+	for (i = 0; i < writer->n; i++) {
+		item = &writer->items[i];
+		if (n > 0 && compare_bundle_names(&writer->items[n - 1],
+						  item) == 0) {
+			z_log_error("Name %.*s is twice in the bundle. "
+				    "Ignoring the later one.\n",
+				    (int) item->namelen, item->namestr);
+			ret = -1;
+			continue;
+		}
+		writer->items[n++] = *item;
+		put_le64(record, item->offset);
+		put_le64(record + 8, item->length);
+		put_le32(record + 16, item->name);
+		put_le32(record + 20, item->namelen);
+		put_le32(record + 24, item->meta);
+		put_le32(record + 28, item->metalen);
+		if (xfwrite(record, 1, sizeof record, writer->f) !=
+		    sizeof record)
+			return -1;
+	}
+	if (xfwrite(writer->pool.data, 1, writer->pool.size, writer->f) !=
+	    writer->pool.size)
+		return -1;
+
+	writer->n = n;
+
+	put_le64(footer, writer->offset);
+	put_le64(footer + 8, writer->n);
+	put_le64(footer + 16, writer->pool.size);
+	memcpy(footer + 24, BUNDLE_INDEX_MAGIC, BUNDLE_MAGIC_LEN);
+	if (xfwrite(footer, 1, sizeof footer, writer->f) != sizeof footer)
+		return -1;
+	return ret;
+}
+
+static void bundle_writer_free(struct bundle_writer *writer)
+{
+	free(writer->items);
+	free(writer->pool.data);
+}
+
+struct bundle_scan {
+	struct bundle_writer *writer;
+	int ret;
+};
+
+static void bundle_add_file(const char *path, const char *name,
+			    void *context)
+{
+	struct bundle_scan *scan = context;
+	struct rmc_reader reader;
+
+	/* Nothing is added after an error */
+	if (scan->ret)
+		return;
+	if (rmc_reader_open(&reader, path)) {
+		scan->ret = -1;
+		return;
+	}
+	if (bundle_writer_add(scan->writer, name, reader.map, reader.mapsize))
+		scan->ret = -1;
+	else
+		fprintf(stderr, "Added %s as %s\n", path, name);
+	rmc_reader_close(&reader);
+}
+
+/* Add RMC files to the bundle, named as in walk_rmc_files() */
+static int bundle_add_paths(struct bundle_writer *writer, int i, int argc,
+			    char *argv[])
+{
+	struct bundle_scan scan = {.writer = writer};
+
+	if (walk_rmc_files(i, argc, argv, bundle_add_file, &scan))
+		return -1;
+	return scan.ret;
+}
+
+static int bundle_create(int i, int argc, char *argv[], char *bundlename)
+{
+	struct bundle_writer writer = {.offset = BUNDLE_MAGIC_LEN};
+	char tmpname[PATH_MAX];
+	int ret;
+
+	writer.f = create_temp_file(tmpname, sizeof tmpname, bundlename);
+	if (writer.f == NULL)
+		return 1;
+	ret = xfwrite(BUNDLE_MAGIC, 1, BUNDLE_MAGIC_LEN, writer.f) ==
+		BUNDLE_MAGIC_LEN ? 0 : -1;
+	if (ret == 0)
+		ret = bundle_add_paths(&writer, i, argc, argv);
+	if (ret == 0)
+		ret = bundle_writer_finish(&writer);
+	ret = finish_temp_file(writer.f, tmpname, bundlename, ret);
+	if (ret == 0)
+		fprintf(stderr, "Created bundle %s with %zu containers\n",
+			bundlename, writer.n);
+	bundle_writer_free(&writer);
+	return ret != 0;
+}
+
+/*
+ * Append containers to an existing bundle. The containers of the old
+ * bundle, the new containers and a new index are written to a temp file,
+ * which replaces the bundle. Readers that have the old bundle mapped keep
+ * a valid index, and the bundle is unchanged if appending fails.
+ */
+static int bundle_append(int i, int argc, char *argv[], char *bundlename)
+{
+	struct bundle_writer writer = {.f = NULL};
+	struct rmc_bundle bundle;
+	struct rmc_bundle_entry entry;
+	char tmpname[PATH_MAX];
+	size_t j;
+	int ret = -1;
+
+	if (rmc_bundle_open(&bundle, bundlename))
+		return 1;
+	writer.offset = bundle.index_offset;
+	for (j = 0; j < bundle.n; j++) {
+		if (rmc_bundle_get(&bundle, j, &entry)) {
+			z_log_error("Invalid bundle index: %s\n", bundlename);
+			goto out;
+		}
+		bundle_writer_add_item(
+			&writer, (const char *) entry.container.data -
+			(const char *) bundle.map, entry.container.size,
+			&entry.name, &entry.meta);
+	}
+
+	writer.f = create_temp_file(tmpname, sizeof tmpname, bundlename);
+	if (writer.f == NULL)
+		goto out;
+	/* The header and the old containers are copied as they are */
+	ret = xfwrite(bundle.map, 1, bundle.index_offset, writer.f) ==
+		bundle.index_offset ? 0 : -1;
+	if (ret == 0)
+		ret = bundle_add_paths(&writer, i, argc, argv);
+	if (ret == 0)
+		ret = bundle_writer_finish(&writer);
+	ret = finish_temp_file(writer.f, tmpname, bundlename, ret);
+	if (ret == 0)
+		fprintf(stderr, "Bundle %s has %zu containers\n", bundlename,
+			writer.n);
+out:
+	rmc_bundle_close(&bundle);
+	bundle_writer_free(&writer);
+	return ret != 0;
+}
+
+static int bundle_list(int i, int argc, char *argv[], char *_unused)
+{
+	struct rmc_bundle bundle;
+	struct rmc_bundle_entry entry;
+	struct bencode *meta;
+	char *metastring;
+	size_t j;
+	int exitval = 0;
+
+	(void) _unused;
+
+	for (; i < argc; i++) {
+		if (rmc_bundle_open(&bundle, argv[i])) {
+			exitval = 1;
+			continue;
+		}
+		for (j = 0; j < bundle.n; j++) {
+			if (rmc_bundle_get(&bundle, j, &entry)) {
+				z_log_error("Invalid bundle index: %s\n",
+					    argv[i]);
+				exitval = 1;
+				break;
+			}
+			meta = ben_decode(entry.meta.data, entry.meta.size);
+			metastring = meta != NULL ? ben_print(meta) : NULL;
+			printf("%.*s\t%zu\t%s\n", (int) entry.name.size,
+			       (const char *) entry.name.data,
+			       entry.container.size,
+			       metastring != NULL ? metastring : "");
+			free(metastring);
+			ben_free(meta);
+		}
+		rmc_bundle_close(&bundle);
+	}
+	return exitval;
+}
+
+static int bundle_extract_entry(const char *dir,
+				const struct rmc_bundle_entry *entry)
+{
+	char name[PATH_MAX];
+	char path[PATH_MAX];
+	char dname[PATH_MAX];
+	char tmpname[PATH_MAX];
+	FILE *f;
+	int ret;
+
+	/* Names must stay inside dir */
+	if (view_to_cstr(name, sizeof name, &entry->name) || name[0] == 0 ||
+	    name[0] == '/' ||
+	    strcmp(name, "..") == 0 || strncmp(name, "../", 3) == 0 ||
+	    strstr(name, "/../") != NULL ||
+	    (strlen(name) >= 3 && strcmp(name + strlen(name) - 3, "/..") == 0)) {
+		z_log_error("Invalid name in bundle: %s\n", name);
+		return -1;
+	}
+	ret = snprintf(path, sizeof path, "%s/%s", dir, name);
+	if (ret < 0 || ((size_t) ret) >= sizeof path) {
+		z_log_error("Too long path: %s/%s\n", dir, name);
+		return -1;
+	}
+	xdirname(dname, sizeof dname, path);
+	if (make_dirs(dname)) {
+		z_log_error("Can not create directory %s (%s)\n", dname,
+			    strerror(errno));
+		return -1;
+	}
+	f = create_temp_file(tmpname, sizeof tmpname, path);
+	if (f == NULL)
+		return -1;
+	ret = xfwrite(entry->container.data, 1, entry->container.size, f) ==
+		entry->container.size ? 0 : -1;
+	ret = finish_temp_file(f, tmpname, path, ret);
+	if (ret == 0)
+		fprintf(stderr, "Extracted %s\n", path);
+	return ret;
+}
+
+/*
+ * Extract containers from a bundle into dir: all of them, or the ones
+ * named after the bundle name.
+ */
+static int bundle_extract(int i, int argc, char *argv[], char *dir)
+{
+	struct rmc_bundle bundle;
+	struct rmc_bundle_entry entry;
+	size_t j;
+	int exitval = 0;
+
+	if (i >= argc)
+		z_log_fatal("Expect bundle name as an argument\n");
+	if (rmc_bundle_open(&bundle, argv[i]))
+		return 1;
+
+	if ((i + 1) == argc) {
+		for (j = 0; j < bundle.n; j++) {
+			if (rmc_bundle_get(&bundle, j, &entry) ||
+			    bundle_extract_entry(dir, &entry))
+				exitval = 1;
+		}
+	}
+	for (i++; i < argc; i++) {
+		if (rmc_bundle_find(&bundle, argv[i], &entry)) {
+			z_log_error("%s is not in the bundle\n", argv[i]);
+			exitval = 1;
+		} else if (bundle_extract_entry(dir, &entry)) {
+			exitval = 1;
+		}
+	}
+	rmc_bundle_close(&bundle);
+	return exitval;
+}
 
-	/* state can be NULL */
-	uade_cleanup_state(state);
+/*
+ * Collection index (--index). The meta of each RMC file in the given
+ * directories is stored in fixed-width records and a string pool, so
+ * that the index can be mmap'ed and searched instead of decoding the
+ * containers. Records are sorted by path, and a second table orders them
+ * by content hash. See doc/rmc-index-format.
+ */
+#define INDEX_MAGIC "RMCINDX1"
+#define INDEX_MAGIC_LEN 8
+#define INDEX_HEADER_SIZE 32
+#define INDEX_RECORD_SIZE 72
+
+/* Strings of a record. Each is an offset and a length in the pool. */
+enum index_field {
+	INDEX_PATH,
+	INDEX_TITLE,
+	INDEX_FORMAT,
+	INDEX_AUTHORS,
+	INDEX_SUBSONGS,
+	INDEX_NUM_FIELDS,
+};
 
-	z_free_and_null(config);
+struct rmc_index {
+	const char *fname;
+	void *map;
+	size_t mapsize;
+	const uint8_t *records;
+	/* 32-bit record numbers sorted by content hash */
+	const uint8_t *byhash;
+	size_t n;
+	const char *pool;
+	size_t poolsize;
+};
 
-	ben_free(scanner_file_list);
-	scanner_file_list = NULL;
+/* An entry of an index. The views point into the mapped index. */
+struct rmc_index_entry {
+	uint64_t mtime;  /* nanoseconds */
+	uint64_t size;
+	struct rmc_hash hash;
+	struct rmc_view fields[INDEX_NUM_FIELDS];
+};
 
-	return exitval;
+static void rmc_index_close(struct rmc_index *index)
+{
+	if (index->map != NULL)
+		munmap(index->map, index->mapsize);
+	*index = (struct rmc_index) {.map = NULL};
 }
 
-
-static struct bencode *get_container(struct uade_file *f)
+/* Returns 0 on success, or -1 if the record i is invalid */
+static int rmc_index_get(const struct rmc_index *index, size_t i,
+			 struct rmc_index_entry *entry)
 {
-	struct bencode *container = ben_decode(f->data, f->size);
-	if (container == NULL) {
-		z_log_error("Unable to decode %s\n", f->name);
-		return NULL;
-	}
+	const uint8_t *record = index->records + i * INDEX_RECORD_SIZE;
+	uint32_t offset;
+	uint32_t length;
+	int k;
 
-	if (!ben_is_list(container) || ben_list_len(container) < 3) {
-		z_log_error("Invalid container format: no main list: %s\n", f->name);
-		goto err;
+	if (i >= index->n)
+		return -1;
+	entry->mtime = load_le64(record);
+	entry->size = load_le64(record + 8);
+	entry->hash.h[0] = load_le64(record + 16);
+	entry->hash.h[1] = load_le64(record + 24);
+	for (k = 0; k < INDEX_NUM_FIELDS; k++) {
+		offset = load_le32(record + 32 + 8 * k);
+		length = load_le32(record + 36 + 8 * k);
+		if (offset > index->poolsize ||
+		    length > index->poolsize - offset)
+			return -1;
+		entry->fields[k] = (struct rmc_view) {
+			.data = index->pool + offset, .size = length};
 	}
+	/* Subsongs are pairs of 32-bit subsong number and milliseconds */
+	if (entry->fields[INDEX_SUBSONGS].size % 8)
+		return -1;
+	return 0;
+}
 
-	if (!ben_is_dict(ben_list_get(container, 1)) ||
-	    !ben_is_dict(ben_list_get(container, 2))) {
-		z_log_error("Either meta or files is not a dictionary: %s\n",
-			    f->name);
-		goto err;
+/* Find a record by path. Returns 0 on success, or -1 if not found. */
+static int rmc_index_find(const struct rmc_index *index, const char *path,
+			  struct rmc_index_entry *entry)
+{
+	size_t low = 0;
+	size_t high = index->n;
+	size_t mid;
+	int ret;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (rmc_index_get(index, mid, entry))
+			return -1;
+		ret = compare_view_to_str(&entry->fields[INDEX_PATH], path);
+		if (ret == 0)
+			return 0;
+		if (ret < 0)
+			low = mid + 1;
+		else
+			high = mid;
 	}
+	return -1;
+}
 
-	return container;
+static int compare_hashes(const struct rmc_hash *x, const struct rmc_hash *y)
+{
+	if (x->h[0] != y->h[0])
+		return x->h[0] > y->h[0] ? 1 : -1;
+	return (x->h[1] > y->h[1]) - (x->h[1] < y->h[1]);
+}
 
-err:
-	ben_free(container);
-	return NULL;
+/*
+ * Find the first position in the hash order whose record has a content
+ * hash that is not less than hash. Returns index->n if there is none, or
+ * (size_t) -1 if the index is invalid.
+ */
+static size_t rmc_index_find_hash(const struct rmc_index *index,
+				  const struct rmc_hash *hash)
+{
+	struct rmc_index_entry entry;
+	size_t low = 0;
+	size_t high = index->n;
+	size_t mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (rmc_index_get(index, load_le32(index->byhash + 4 * mid),
+				  &entry))
+			return (size_t) -1;
+		if (compare_hashes(&entry.hash, hash) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
 }
 
-static int unpack_meta(const char *dirname, struct bencode *container)
+static int rmc_index_open(struct rmc_index *index, const char *fname)
 {
-	char metaname[PATH_MAX];
-	char *metastring = NULL;
-	FILE *f;
-	int ret = snprintf(metaname, sizeof metaname, "%s/meta", dirname);
-	z_assert(ret >= 0 && ((size_t) ret) < sizeof(metaname));
+	const uint8_t *header;
+	uint64_t count;
+	uint64_t poolsize;
 
-	f = fopen(metaname, "wb");
-	if (f == NULL) {
-		z_log_error("Can not open meta file for writing: %s (%s)\n", metaname, strerror(errno));
-		goto err;
-	}
+	*index = (struct rmc_index) {.fname = fname};
 
-	metastring = ben_print(ben_list_get(container, 1));
-	if (metastring == NULL) {
-		z_log_error("Can not generate meta string\n");
+	if (map_file(&index->map, &index->mapsize, fname, INDEX_HEADER_SIZE,
+		     "an index"))
+		return -1;
+
+	header = index->map;
+	if (memcmp(header, INDEX_MAGIC, INDEX_MAGIC_LEN)) {
+		z_log_error("%s is not an index\n", fname);
 		goto err;
 	}
-
-	if (xfwrite(metastring, strlen(metastring), 1, f) != 1) {
-		z_log_error("Write error to meta file %s (%s)\n",
-			    metaname, strerror(errno));
+	count = load_le64(header + 8);
+	poolsize = load_le64(header + 16);
+	if (count > (index->mapsize - INDEX_HEADER_SIZE) /
+	    (INDEX_RECORD_SIZE + 4) ||
+	    /* The pool fills the rest. Subtract so that nothing overflows. */
+	    poolsize != index->mapsize - INDEX_HEADER_SIZE -
+	    count * (INDEX_RECORD_SIZE + 4)) {
+		z_log_error("Invalid index: %s\n", fname);
 		goto err;
 	}
-
-	free(metastring);
-	fclose(f);
+	index->n = count;
+	index->records = header + INDEX_HEADER_SIZE;
+	index->byhash = index->records + count * INDEX_RECORD_SIZE;
+	index->pool = (const char *) index->byhash + count * 4;
+	index->poolsize = poolsize;
 	return 0;
 
 err:
-	if (f != NULL)
-		fclose(f);
-	free(metastring);
+	rmc_index_close(index);
 	return -1;
+}
+
+/*
+ * Index writer. Records are collected in memory and written by
+ * index_writer_finish(). Records of an old index are reused for files
+ * whose mtime and size have not changed.
+ */
+struct index_item {
+	uint64_t mtime;
+	uint64_t size;
+	struct rmc_hash hash;
+	uint32_t fields[INDEX_NUM_FIELDS][2];
+	/* Set after the pool is complete, for sorting */
+	const char *pathstr;
+	size_t order;
+	uint32_t record;
+};
+
+struct index_writer {
+	struct index_item *items;
+	size_t n;
+	size_t allocated;
+	struct string_pool pool;
+	struct rmc_index old;
+	size_t reused;
+	int ret;
+};
+
+static void index_set_field(struct index_writer *writer,
+			    struct index_item *item, enum index_field k,
+			    const void *data, size_t len)
+{
+	item->fields[k][0] = string_pool_add(&writer->pool, data, len);
+	item->fields[k][1] = len;
+}
 
+static void index_set_str(struct index_writer *writer, struct index_item *item,
+			  enum index_field k, const struct bencode *meta,
+			  const char *key)
+{
+	struct bencode *value = ben_dict_get_by_str(meta, key);
+	if (value != NULL && ben_is_str(value))
+		index_set_field(writer, item, k, ben_str_val(value),
+				ben_str_len(value));
 }
 
-static int scan_and_write_files(const struct bencode *files,
-				const char *oldprefix)
+static int compare_subsong_pairs(const void *a, const void *b)
 {
-	size_t pos;
+	const uint32_t *x = a;
+	const uint32_t *y = b;
+	return (x[0] > y[0]) - (x[0] < y[0]);
+}
+
+static void index_set_meta(struct index_writer *writer,
+			   struct index_item *item, const struct bencode *meta)
+{
+	struct bencode *authors = ben_dict_get_by_str(meta, "authors");
+	struct bencode *subsongs = ben_dict_get_by_str(meta, "subsongs");
 	struct bencode *key;
 	struct bencode *value;
-	char prefix[PATH_MAX];
-	FILE *f;
-
-	ben_dict_for_each(key, value, pos, files) {
-		if (!ben_is_str(key)) {
-			z_log_error("File name must be a string\n");
-			return 1;
-		}
-		if (strcmp(ben_str_val(key), "..") == 0 ||
-		    strcmp(ben_str_val(key), ".") == 0 ||
-		    strstr(ben_str_val(key), "/") != NULL) {
-			z_log_error("Invalid name: %s\n", ben_str_val(key));
-			return 1;
+	uint32_t *pairs;
+	uint8_t pair[8];
+	size_t start;
+	size_t pos;
+	size_t nauthors = 0;
+	size_t n = 0;
+	size_t j;
+
+	index_set_str(writer, item, INDEX_TITLE, meta, "title");
+	index_set_str(writer, item, INDEX_FORMAT, meta, "format");
+
+	/* Authors are separated with '\n' */
+	if (authors != NULL && ben_is_list(authors)) {
+		start = writer->pool.size;
+		ben_list_for_each(value, pos, authors) {
+			if (!ben_is_str(value))
+				continue;
+			/* The first author may be an empty string */
+			if (nauthors++ > 0)
+				string_pool_add(&writer->pool, "\n", 1);
+			string_pool_add(&writer->pool, ben_str_val(value),
+					ben_str_len(value));
 		}
+		item->fields[INDEX_AUTHORS][0] = start;
+		item->fields[INDEX_AUTHORS][1] = writer->pool.size - start;
+	}
 
-		if (ben_is_dict(value)) {
-			snprintf(prefix, sizeof prefix, "%s%s/", oldprefix,
-				 ben_str_val(key));
-			if (mkdir(prefix, 0700)) {
-				z_log_error("Unable to create directory "
-					    "%s (%s)\n",
-					    prefix, strerror(errno));
-				return 1;
-			}
-			if (scan_and_write_files(value, prefix))
-				return 1;
+	if (subsongs == NULL || !ben_is_dict(subsongs))
+		return;
+	pairs = calloc(2 * ben_dict_len(subsongs) + 1, sizeof pairs[0]);
+	if (pairs == NULL)
+		z_die("No memory for subsongs\n");
+	ben_dict_for_each(key, value, pos, subsongs) {
+		if (!ben_is_int(key) || !ben_is_int(value) ||
+		    ben_int_val(key) < 0 || ben_int_val(key) > UINT32_MAX ||
+		    ben_int_val(value) < 0 || ben_int_val(value) > UINT32_MAX)
 			continue;
-		}
+		pairs[2 * n] = ben_int_val(key);
+		pairs[2 * n + 1] = ben_int_val(value);
+		n++;
+	}
+	qsort(pairs, n, 2 * sizeof pairs[0], compare_subsong_pairs);
+	start = writer->pool.size;
+	for (j = 0; j < n; j++) {
+		put_le32(pair, pairs[2 * j]);
+		put_le32(pair + 4, pairs[2 * j + 1]);
+		string_pool_add(&writer->pool, pair, sizeof pair);
+	}
+	item->fields[INDEX_SUBSONGS][0] = start;
+	item->fields[INDEX_SUBSONGS][1] = writer->pool.size - start;
+	free(pairs);
+}
 
-		if (!ben_is_str(value)) {
-			z_log_error("Invalid file content: %s\n",
-				    ben_str_val(key));
-			return 1;
-		}
-		snprintf(prefix, sizeof prefix, "%s%s",
-			 oldprefix, ben_str_val(key));
-		f = fopen(prefix, "wb");
-		if (f == NULL) {
-			z_log_error("Can not write file");
-			return 1;
-		}
-		if (xfwrite(ben_str_val(value), ben_str_len(value), 1,
-			    f) != 1) {
-			z_log_error("Unable to write to file: %s (%s)\n",
-				    prefix, strerror(errno));
-			fclose(f);
-			return 1;
-		}
-		fclose(f);
-		f = NULL;
+static struct index_item *index_writer_new_item(struct index_writer *writer)
+{
+	struct index_item *items;
+	if (writer->n == writer->allocated) {
+		writer->allocated = writer->allocated ?
+			2 * writer->allocated : 64;
+		items = realloc(writer->items,
+				writer->allocated * sizeof items[0]);
+		if (items == NULL)
+			z_die("No memory for index\n");
+		writer->items = items;
 	}
-	return 0;
+	writer->items[writer->n] = (struct index_item) {.order = writer->n};
+	return &writer->items[writer->n++];
 }
 
-static int unpack_files(const char *dirname, struct bencode *container)
+/* Add the file at path with the given name to the index */
+static void index_add_file(const char *path, const char *name, void *context)
 {
-	struct bencode *files = ben_list_get(container, 2);
-	char prefix[PATH_MAX];
-	int ret;
+	struct index_writer *writer = context;
+	struct rmc_index_entry entry;
+	struct rmc_reader reader;
+	struct index_item *item;
+	struct bencode *meta;
+	struct stat st;
+	uint64_t mtime;
+	int k;
 
-	/* Note, trailing / is important in prefix string */
-	ret = snprintf(prefix, sizeof prefix, "%s/files/", dirname);
-	z_assert(ret >= 0 && ((size_t) ret) < sizeof(prefix));
+	if (stat(path, &st)) {
+		z_log_error("Can not stat %s (%s)\n", path, strerror(errno));
+		writer->ret = -1;
+		return;
+	}
+	mtime = (uint64_t) st.st_mtim.tv_sec * 1000000000 +
+		st.st_mtim.tv_nsec;
+
+	if (writer->old.map != NULL &&
+	    rmc_index_find(&writer->old, name, &entry) == 0 &&
+	    entry.mtime == mtime && entry.size == (uint64_t) st.st_size) {
+		item = index_writer_new_item(writer);
+		item->mtime = mtime;
+		item->size = entry.size;
+		item->hash = entry.hash;
+		for (k = 0; k < INDEX_NUM_FIELDS; k++)
+			index_set_field(writer, item, k, entry.fields[k].data,
+					entry.fields[k].size);
+		writer->reused++;
+		return;
+	}
 
-	if (mkdir(prefix, 0700)) {
-		if (errno != EEXIST) {
-			z_log_error("Unable to create directory %s (%s)\n",
-				    prefix, strerror(errno));
-			return -1;
-		}
+	if (rmc_reader_open(&reader, path)) {
+		writer->ret = -1;
+		return;
 	}
-	if (scan_and_write_files(files, prefix)) {
-		z_log_error("Can not unpack RMC to %s\n", dirname);
-		return -1;
+	meta = rmc_reader_get_meta(&reader);
+	if (meta == NULL || !ben_is_dict(meta)) {
+		z_log_error("Invalid meta: %s\n", path);
+		writer->ret = -1;
+		goto out;
 	}
-	return 0;
+	item = index_writer_new_item(writer);
+	item->mtime = mtime;
+	item->size = reader.mapsize;
+	rmc_hash(&item->hash, reader.map, reader.mapsize, 0);
+	index_set_field(writer, item, INDEX_PATH, name, strlen(name));
+	index_set_meta(writer, item, meta);
+	fprintf(stderr, "Indexed %s\n", path);
+out:
+	ben_free(meta);
+	rmc_reader_close(&reader);
 }
 
-static int unpack_file(const char *dir, struct uade_file *f)
+/* Add RMC files to the index, named as in walk_rmc_files() */
+static void index_add_paths(struct index_writer *writer, int i, int argc,
+			    char *argv[])
 {
-	struct bencode *container;
+	if (walk_rmc_files(i, argc, argv, index_add_file, writer))
+		writer->ret = -1;
+}
 
-	if (!uade_is_rmc(f->data, f->size)) {
-		z_log_error("%s is not an RMC file\n", f->name);
-		return 1;
-	}
+static int compare_index_paths(const struct index_item *x,
+			       const struct index_item *y)
+{
+	return compare_names(x->pathstr, x->fields[INDEX_PATH][1],
+			     y->pathstr, y->fields[INDEX_PATH][1]);
+}
 
-	container = get_container(f);
-	if (container == NULL)
-		goto cleanup;
+static int compare_index_items(const void *a, const void *b)
+{
+	const struct index_item *x = a;
+	const struct index_item *y = b;
+	int ret = compare_index_paths(x, y);
+	if (ret != 0)
+		return ret;
+	return (x->order > y->order) - (x->order < y->order);
+}
 
-	if (unpack_meta(dir, container))
-		goto cleanup;
+static int compare_index_hashes(const void *a, const void *b)
+{
+	const struct index_item * const *x = a;
+	const struct index_item * const *y = b;
+	int ret = compare_hashes(&(*x)->hash, &(*y)->hash);
+	if (ret != 0)
+		return ret;
+	return ((*x)->record > (*y)->record) - ((*x)->record < (*y)->record);
+}
 
-	if (unpack_files(dir, container))
-		goto cleanup;
+/*
+ * Write the index to f. If a path is in the index twice, the first one is
+ * kept and writer->ret is set to -1. Returns -1 on write error.
+ */
+static int index_writer_finish(struct index_writer *writer, FILE *f)
+{
+	uint8_t header[INDEX_HEADER_SIZE];
+	uint8_t record[INDEX_RECORD_SIZE];
+	struct index_item **byhash;
+	struct index_item *item;
+	size_t n = 0;
+	size_t i;
+	int k;
+
+	if (writer->n > UINT32_MAX)
+		z_die("Index is too large\n");
+	for (i = 0; i < writer->n; i++) {
+		item = &writer->items[i];
+		item->pathstr = writer->pool.data + item->fields[INDEX_PATH][0];
+	}
+	if (writer->n > 0)
+		qsort(writer->items, writer->n, sizeof writer->items[0],
+		      compare_index_items);
+	for (i = 0; i < writer->n; i++) {
+		item = &writer->items[i];
+		if (n > 0 && compare_index_paths(&writer->items[n - 1],
+						 item) == 0) {
+			z_log_error("Path %.*s is twice in the index. "
+				    "Ignoring the later one.\n",
+				    (int) item->fields[INDEX_PATH][1],
+				    item->pathstr);
+			writer->ret = -1;
+			continue;
+		}
+		item->record = n;
+		writer->items[n++] = *item;
+	}
+	writer->n = n;
 
-	ben_free(container);
-	fprintf(stderr, "Unpacked %s to directory %s (OK)\n", f->name, dir);
+	memset(header, 0, sizeof header);
+	memcpy(header, INDEX_MAGIC, INDEX_MAGIC_LEN);
+	put_le64(header + 8, writer->n);
+	put_le64(header + 16, writer->pool.size);
+	if (xfwrite(header, 1, sizeof header, f) != sizeof header)
+		return -1;
+
+	byhash = malloc((writer->n + 1) * sizeof byhash[0]);
+	if (byhash == NULL)
+		z_die("No memory for index\n");
+	for (i = 0; i < writer->n; i++) {
+		item = &writer->items[i];
+		byhash[i] = item;
+		put_le64(record, item->mtime);
+		put_le64(record + 8, item->size);
+		put_le64(record + 16, item->hash.h[0]);
+		put_le64(record + 24, item->hash.h[1]);
+		for (k = 0; k < INDEX_NUM_FIELDS; k++) {
+			put_le32(record + 32 + 8 * k, item->fields[k][0]);
+			put_le32(record + 36 + 8 * k, item->fields[k][1]);
+		}
+		if (xfwrite(record, 1, sizeof record, f) != sizeof record)
+			goto err;
+	}
+	qsort(byhash, writer->n, sizeof byhash[0], compare_index_hashes);
+	for (i = 0; i < writer->n; i++) {
+		put_le32(record, byhash[i]->record);
+		if (xfwrite(record, 1, 4, f) != 4)
+			goto err;
+	}
+	free(byhash);
+	if (xfwrite(writer->pool.data, 1, writer->pool.size, f) !=
+	    writer->pool.size)
+		return -1;
 	return 0;
 
-cleanup:
-	return 1;
+err:
+	free(byhash);
+	return -1;
 }
 
-static int pack_container(int i, int argc, char *argv[], char *pack_dir)
+/*
+ * Create or update an index of the given RMC files and directories. An
+ * existing index is replaced, but its records are reused for files that
+ * have the same mtime and size as before.
+ */
+static int index_create(int i, int argc, char *argv[], char *indexname)
 {
-	struct bencode *container = create_container();
-	struct bencode *meta;
-	struct bencode *files;
-	char *targetname;
-	char files_dir[PATH_MAX];
-	char path[PATH_MAX];
-	void *metabytes;
-	size_t size;
-
-	z_assert(container != NULL);
+	struct index_writer writer = {.items = NULL};
+	char tmpname[PATH_MAX];
+	struct stat st;
+	FILE *f;
+	int ret;
 
-	if ((i + 1) != argc) {
-		z_log_fatal("Expect rmc name as the only non-option "
-			    "argument\n");
-	}
-	targetname = argv[i];
-	z_assert(targetname != NULL);
+	if (stat(indexname, &st) == 0 &&
+	    rmc_index_open(&writer.old, indexname))
+		z_log_warning("Rebuilding invalid index %s\n", indexname);
 
-	z_snprintf_or_die(path, sizeof(path), "%s/meta", pack_dir);
-	metabytes = z_file_read(&size, path);
-	z_assert(metabytes != NULL);
+	index_add_paths(&writer, i, argc, argv);
+	/* Strings of the old index have been copied */
+	rmc_index_close(&writer.old);
 
-	meta = ben_decode_printed(metabytes, size);
-	z_assert(meta != NULL);
-	ben_list_set(container, 1, meta);
+	f = create_temp_file(tmpname, sizeof tmpname, indexname);
+	if (f == NULL) {
+		ret = -1;
+		goto out;
+	}
+	ret = index_writer_finish(&writer, f);
+	/* The index is written even if some files could not be read */
+	ret = finish_temp_file(f, tmpname, indexname, ret);
+	if (ret == 0)
+		fprintf(stderr, "Index %s has %zu files (%zu unchanged)\n",
+			indexname, writer.n, writer.reused);
+	if (writer.ret)
+		ret = -1;
+out:
+	free(writer.items);
+	free(writer.pool.data);
+	return ret != 0;
+}
 
-	z_snprintf_or_die(files_dir, sizeof(files_dir), "%s/files", pack_dir);
-	files = ben_list_get(container, 2);
-	struct str_array *names = z_list_dir(files_dir);
-	struct str_array_iter iter;
-	z_assert(names != NULL);
-	z_array_for_each(str_array, names, &iter) {
-		z_snprintf_or_die(path, sizeof(path),
-				  "%s/%s", files_dir, iter.value);
-		void *filebytes = z_file_read(&size, path);
-		z_assert(filebytes != NULL);
-		struct bencode *benbytes = ben_blob(filebytes, size);
-		z_assert(benbytes != NULL);
-		z_assert(ben_dict_set_by_str(files, iter.value,
-					     benbytes) == 0);
+static void print_index_entry(const struct rmc_index_entry *entry)
+{
+	const struct rmc_view *authors = &entry->fields[INDEX_AUTHORS];
+	const struct rmc_view *subsongs = &entry->fields[INDEX_SUBSONGS];
+	const uint8_t *pair;
+	char hex[33];
+	size_t j;
+
+	rmc_hash_to_hex(hex, &entry->hash);
+	printf("%.*s\t%s\t%llu\t%.*s\t%.*s\t",
+	       (int) entry->fields[INDEX_PATH].size,
+	       entry->fields[INDEX_PATH].data, hex,
+	       (unsigned long long) entry->size,
+	       (int) entry->fields[INDEX_TITLE].size,
+	       entry->fields[INDEX_TITLE].data,
+	       (int) entry->fields[INDEX_FORMAT].size,
+	       entry->fields[INDEX_FORMAT].data);
+	for (j = 0; j < authors->size; j++) {
+		if (authors->data[j] == '\n')
+			fputs(", ", stdout);
+		else
+			putchar(authors->data[j]);
+	}
+	putchar('\t');
+	for (j = 0; j < subsongs->size; j += 8) {
+		pair = (const uint8_t *) subsongs->data + j;
+		printf("%s%u:%u", j > 0 ? " " : "", load_le32(pair),
+		       load_le32(pair + 4));
 	}
-	str_array_free_all(names);
+	putchar('\n');
+}
 
-	return write_rmc(targetname, container);
+static int parse_hash_hex(struct rmc_hash *hash, const char *hex)
+{
+	unsigned long long h[2];
+	if (strlen(hex) != 32 || strspn(hex, "0123456789abcdef") != 32 ||
+	    sscanf(hex, "%16llx%16llx", &h[0], &h[1]) != 2)
+		return -1;
+	hash->h[0] = h[0];
+	hash->h[1] = h[1];
+	return 0;
 }
 
-static int unpack_container(int i, int argc, char *argv[], char *unpack_dir)
+/*
+ * Print records of an index: all of them, or the ones given after the
+ * index name by path or by content hash in hex. Fields are separated with
+ * tabs: path, hash, size, title, format, authors and subsongs.
+ */
+static int index_list(int i, int argc, char *argv[], char *_unused)
 {
+	struct rmc_index index;
+	struct rmc_index_entry entry;
+	struct rmc_hash hash;
+	size_t j;
+	int found;
 	int exitval = 0;
-	struct uade_file *f;
 
-	if (recursive_mode)
-		z_die("Recursive mode is not yet implemented for unpacking.");
+	(void) _unused;
 
-	if ((i + 1) != argc) {
-		z_log_fatal("Expect rmc name as the only non-option "
-			    "argument\n");
+	if (i >= argc)
+		z_log_fatal("Expect index name as an argument\n");
+	if (rmc_index_open(&index, argv[i]))
+		return 1;
+
+	if ((i + 1) == argc) {
+		for (j = 0; j < index.n; j++) {
+			if (rmc_index_get(&index, j, &entry)) {
+				z_log_error("Invalid index: %s\n", argv[i]);
+				exitval = 1;
+				break;
+			}
+			print_index_entry(&entry);
+		}
+	}
+	for (i++; i < argc; i++) {
+		if (rmc_index_find(&index, argv[i], &entry) == 0) {
+			print_index_entry(&entry);
+			continue;
+		}
+		found = 0;
+		if (parse_hash_hex(&hash, argv[i]) == 0) {
+			for (j = rmc_index_find_hash(&index, &hash);
+			     j < index.n; j++) {
+				if (rmc_index_get(&index,
+						  load_le32(index.byhash +
+							    4 * j), &entry) ||
+				    compare_hashes(&entry.hash, &hash) != 0)
+					break;
+				print_index_entry(&entry);
+				found = 1;
+			}
+		}
+		if (!found) {
+			z_log_error("%s is not in the index\n", argv[i]);
+			exitval = 1;
+		}
 	}
+	rmc_index_close(&index);
+	return exitval;
+}
 
-	f = uade_file_load(argv[i]);
-	if (f == NULL) {
-		z_log_error("Can not open file %s\n", argv[i]);
-		return 1;
+/*
+ * Container codec benchmark (--bench-codec). Synthetic containers from
+ * 1 KiB to 64 MiB are encoded and decoded with bencode-tools, streamed
+ * with the container writer and read with the zero-copy reader. Results
+ * are printed as CSV.
+ */
+#define BENCH_MIN_SIZE 1024
+#define BENCH_MAX_SIZE (64 * 1024 * 1024)
+#define BENCH_SAMPLE_SIZE (16 * 1024)
+#define BENCH_MIN_TIME 0.5
+#define BENCH_MIN_ITERATIONS 3
+
+static struct bencode *create_bench_container(size_t size)
+{
+	struct bencode *container = create_container();
+	struct bencode *files = ben_list_get(container, 2);
+	struct bencode *meta = ben_list_get(container, 1);
+	char name[32];
+	char *data = malloc(size);
+	size_t left = size;
+	size_t len;
+	size_t i;
+	int n = 0;
+
+	if (data == NULL)
+		z_die("No memory for benchmark data\n");
+	/* Pseudo-random contents, like sample data */
+	for (i = 0; i < size; i++)
+		data[i] = (char) ((i * 2654435761U) >> 13);
+
+	set_str_by_str(meta, "format", "ProTracker");
+	set_str_by_str(meta, "title", "benchmark");
+	set_playtime_value(container, 0, 180000);
+
+	/* Half of the data is a song, the rest is samples */
+	len = size / 2;
+	while (left > 0) {
+		snprintf(name, sizeof name, n == 0 ? "mod.bench" : "smpl.%d",
+			 n);
+		if (ben_dict_set_by_str(files, name, ben_blob(data, len)))
+			z_die("Can not create benchmark container\n");
+		left -= len;
+		len = left < BENCH_SAMPLE_SIZE ? left : BENCH_SAMPLE_SIZE;
+		n++;
 	}
+	free(data);
+	return container;
+}
 
-	if (unpack_file(unpack_dir, f))
-		exitval = 1;
+static void print_bench_result(const char *operation, size_t size,
+			       int iterations, double seconds)
+{
+	printf("%s,%zu,%d,%.6f,%.1f\n", operation, size, iterations, seconds,
+	       ((double) size) * iterations / seconds / (1024 * 1024));
+}
 
-	uade_file_free(f);
+/* Temp file template in $TMPDIR, or in /tmp if it is not set */
+static void get_bench_tmpname(char *tmpname, size_t maxlen)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	if (tmpdir == NULL || tmpdir[0] == 0)
+		tmpdir = "/tmp";
+	z_snprintf_or_die(tmpname, maxlen, "%s/rmc-bench.XXXXXX", tmpdir);
+}
 
-	return exitval;
+static int bench_codec(int i, int argc, char *argv[], char *_unused)
+{
+	struct bencode *container;
+	struct bencode *decoded;
+	struct rmc_reader reader;
+	struct rmc_dict_iter iter;
+	struct rmc_view key;
+	struct rmc_view value;
+	char tmpname[PATH_MAX];
+	FILE *devnull;
+	FILE *f;
+	void *data;
+	size_t len;
+	size_t size;
+	double start;
+	double t;
+	int n;
+	int fd;
+
+	(void) i;
+	(void) argc;
+	(void) argv;
+	(void) _unused;
+
+	devnull = fopen("/dev/null", "wb");
+	if (devnull == NULL)
+		z_die("Can not open /dev/null\n");
+
+	printf("operation,container_bytes,iterations,seconds,mib_per_s\n");
+
+	for (size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE; size *= 4) {
+		container = create_bench_container(size);
+		data = ben_encode(&len, container);
+		if (data == NULL)
+			z_die("Can not serialize\n");
+
+		start = gettime();
+		for (n = 0, t = 0; n < BENCH_MIN_ITERATIONS ||
+			     t < BENCH_MIN_TIME; n++, t = gettime() - start)
+			free(ben_encode(&len, container));
+		print_bench_result("ben_encode", len, n, t);
+
+		start = gettime();
+		for (n = 0, t = 0; n < BENCH_MIN_ITERATIONS ||
+			     t < BENCH_MIN_TIME; n++, t = gettime() - start) {
+			decoded = ben_decode(data, len);
+			z_assert(decoded != NULL);
+			ben_free(decoded);
+		}
+		print_bench_result("ben_decode", len, n, t);
+
+		start = gettime();
+		for (n = 0, t = 0; n < BENCH_MIN_ITERATIONS ||
+			     t < BENCH_MIN_TIME; n++, t = gettime() - start) {
+			z_assert(stream_value(devnull, container) == 0);
+			fflush(devnull);
+		}
+		print_bench_result("stream_write", len, n, t);
+
+		get_bench_tmpname(tmpname, sizeof tmpname);
+		fd = mkstemp(tmpname);
+		if (fd < 0)
+			z_die("Can not create %s (%s)\n", tmpname,
+			      strerror(errno));
+		f = fdopen(fd, "wb");
+		z_assert(f != NULL);
+		z_assert(xfwrite(data, 1, len, f) == len);
+		fclose(f);
+		start = gettime();
+		for (n = 0, t = 0; n < BENCH_MIN_ITERATIONS ||
+			     t < BENCH_MIN_TIME; n++, t = gettime() - start) {
+			z_assert(rmc_reader_open(&reader, tmpname) == 0);
+			rmc_dict_iter_init(&iter, &reader.files);
+			while (rmc_dict_next(&iter, &key, &value) > 0)
+				;
+			rmc_reader_close(&reader);
+		}
+		print_bench_result("view_read", len, n, t);
+		unlink(tmpname);
+
+		fflush(stdout);
+		free(data);
+		ben_free(container);
+	}
+
+	fclose(devnull);
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
 	char *end;
+	const char *name;
 	int ret;
+	int fd;
 	int (*operation)(int i, int argc, char *argv[], char *);
 	size_t size;
 	char path[PATH_MAX];
@@ -962,35 +6951,160 @@ int main(int argc, char *argv[])
 	int option_index = 0;
 	const struct option long_options[] = {
 		{"help", no_argument, 0, 'h'},
-		{"repack", no_argument, 0, 0},
+		{"batch-budget", required_argument, 0, 0},
+		{"bench-codec", no_argument, 0, 0},
+		{"bundle-append", required_argument, 0, 0},
+		{"bundle-create", required_argument, 0, 0},
+		{"bundle-extract", required_argument, 0, 0},
+		{"bundle-list", no_argument, 0, 0},
+		{"entry", required_argument, 0, 0},
+		{"file-budget", required_argument, 0, 0},
+		{"file-cache", required_argument, 0, 0},
+		{"index", required_argument, 0, 0},
+		{"index-list", no_argument, 0, 0},
+		{"modland", required_argument, 0, 0},
+		{"no-file-index", no_argument, 0, 0},
+		{"no-io-uring", no_argument, 0, 0},
+		{"repack", optional_argument, 0, 0},
+		{"silence-threshold", required_argument, 0, 0},
+		{"silence-window", required_argument, 0, 0},
+		{"stats-fd", required_argument, 0, 0},
+		{"store", required_argument, 0, 0},
+		{"switch-subsongs", no_argument, 0, 0},
 		{0, 0, 0, 0},
 	};
 
-	iconv_cd = iconv_open("utf-8", "iso-8859-1");
-	z_assert((size_t) iconv_cd != ((size_t) -1));
+	/* umask() can only be read by setting it */
+	file_create_mode = umask(0);
+	umask(file_create_mode);
+	file_create_mode = 0666 & ~file_create_mode;
+
+	init_simd();
 
 	operation = put_files_into_container;
 
 	while (1) {
-		ret = getopt_long(argc, argv, "dhnp:ru:w:", long_options,
+		ret = getopt_long(argc, argv, "c:dhj:J:l:np:rsu:w:", long_options,
 				  &option_index);
 		if (ret  < 0)
 			break;
 		switch (ret) {
 		case 0:
-			if (option_index == 0) {
-				repack_mode = 1;
+			name = long_options[option_index].name;
+			if (strcmp(name, "batch-budget") == 0) {
+				batch_budget = strtod(optarg, &end);
+				if (*end != 0 || batch_budget <= 0)
+					z_die("Invalid batch budget: %s\n",
+					      optarg);
+				batch_budget_left = batch_budget;
+			} else if (strcmp(name, "bench-codec") == 0) {
+				operation = bench_codec;
+			} else if (strcmp(name, "bundle-append") == 0 ||
+				   strcmp(name, "bundle-create") == 0 ||
+				   strcmp(name, "bundle-extract") == 0) {
+				if (strcmp(name, "bundle-append") == 0)
+					operation = bundle_append;
+				else if (strcmp(name, "bundle-create") == 0)
+					operation = bundle_create;
+				else
+					operation = bundle_extract;
+				size = strlcpy(path, optarg, sizeof(path));
+				z_assert(size < sizeof(path));
+				z_assert(strlen(path) > 0);
+			} else if (strcmp(name, "bundle-list") == 0) {
+				operation = bundle_list;
+			} else if (strcmp(name, "entry") == 0) {
+				unpack_entry = optarg;
+			} else if (strcmp(name, "file-budget") == 0) {
+				file_budget = strtod(optarg, &end);
+				if (*end != 0 || file_budget <= 0)
+					z_die("Invalid file budget: %s\n",
+					      optarg);
+			} else if (strcmp(name, "file-cache") == 0) {
+				size = strtoul(optarg, &end, 10);
+				if (*end != 0 || optarg[0] == '-' ||
+				    size > (SIZE_MAX >> 20))
+					z_die("Invalid file cache size: %s\n",
+					      optarg);
+				file_cache_size = size << 20;
+			} else if (strcmp(name, "index") == 0) {
+				operation = index_create;
+				size = strlcpy(path, optarg, sizeof(path));
+				z_assert(size < sizeof(path));
+				z_assert(strlen(path) > 0);
+			} else if (strcmp(name, "index-list") == 0) {
+				operation = index_list;
+			} else if (strcmp(name, "modland") == 0) {
+				if (modland_open(optarg))
+					z_die("Can not load md5 list %s\n",
+					      optarg);
+			} else if (strcmp(name, "no-file-index") == 0) {
+				use_file_index = 0;
+			} else if (strcmp(name, "no-io-uring") == 0) {
+				use_io_uring = 0;
+			} else if (strcmp(name, "repack") == 0) {
+				if (optarg == NULL ||
+				    strcmp(optarg, "meta") == 0)
+					repack_mode = REPACK_META;
+				else if (strcmp(optarg, "full") == 0)
+					repack_mode = REPACK_FULL;
+				else
+					z_die("Invalid repack mode: %s\n",
+					      optarg);
+			} else if (strcmp(name, "silence-threshold") == 0) {
+				silence_threshold = strtol(optarg, &end, 10);
+				if (*end != 0 || silence_threshold < 0 ||
+				    silence_threshold > 32767)
+					z_die("Invalid silence threshold: %s\n",
+					      optarg);
+			} else if (strcmp(name, "stats-fd") == 0) {
+				fd = strtol(optarg, &end, 10);
+				if (*end != 0 || fd < 0)
+					z_die("Invalid stats fd: %s\n", optarg);
+				stats_file = fdopen(fd, "w");
+				if (stats_file == NULL)
+					z_die("Can not open stats fd %d (%s)\n",
+					      fd, strerror(errno));
+			} else if (strcmp(name, "store") == 0) {
+				store_dir = optarg;
+			} else if (strcmp(name, "switch-subsongs") == 0) {
+				switch_subsongs = 1;
+			} else if (strcmp(name, "silence-window") == 0) {
+				silence_window = strtod(optarg, &end);
+				if (*end != 0 || silence_window <= 0)
+					z_die("Invalid silence window: %s\n",
+					      optarg);
 			} else {
 				z_die("Invalid option_index %d\n",
 				      option_index);
 			}
 			break;
+		case 'c':
+			cache_dir = optarg;
+			break;
 		case 'd':
 			delete_after_packing = 1;
 			break;
 		case 'h':
 			print_usage();
 			exit(0);
+		case 'j':
+			njobs = strtol(optarg, &end, 10);
+			if (*end != 0 || njobs < 1)
+				z_die("Invalid number of jobs: %s\n", optarg);
+			break;
+		case 'J':
+			subsong_jobs = strtol(optarg, &end, 10);
+			if (*end != 0 || subsong_jobs < 1)
+				z_die("Invalid number of subsong jobs: %s\n",
+				      optarg);
+			break;
+		case 'l':
+			loop_confirm_time = strtol(optarg, &end, 10);
+			if (*end != 0 || loop_confirm_time < 1)
+				z_die("Invalid loop confirmation time: %s\n",
+				      optarg);
+			break;
 		case 'n':
 			overwrite_mode = 0;
 			break;
@@ -1003,6 +7117,9 @@ int main(int argc, char *argv[])
 		case 'r':
 			recursive_mode = 1;
 			break;
+		case 's':
+			operation = show_metadata;
+			break;
 		case 'u':
 			/* Unpack rmc file */
 			operation = unpack_container;
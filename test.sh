@@ -13,3 +13,155 @@ if ! cmp test-songs/dlm2.ion-cannon4.rmc test.rmc ; then
     echo "Error: Files are different"
     exit 1
 fi
+
+echo "Test that pack && unpack && pack keeps nested directories"
+rm -rf test-nested-dir test-nested-unpack-dir
+mkdir -p test-nested-dir/files/sub test-nested-unpack-dir
+cp test-pack-dir/meta test-nested-dir/
+cp test-songs/dlm2.ion-cannon4 test-nested-dir/files/
+cp test-songs/dlm2.ion-cannon4 test-nested-dir/files/sub/extra
+"${RMC}" -p test-nested-dir test-nested.rmc 2>/dev/null
+"${RMC}" -u test-nested-unpack-dir test-nested.rmc 2>/dev/null
+"${RMC}" -p test-nested-unpack-dir test-nested2.rmc 2>/dev/null
+if ! cmp test-nested.rmc test-nested2.rmc ||
+   ! cmp test-songs/dlm2.ion-cannon4 \
+     test-nested-unpack-dir/files/sub/extra ; then
+    echo "Error: Nested container differs"
+    exit 1
+fi
+
+echo "Test that -s shows metadata"
+if ! "${RMC}" -s test-songs/dlm2.ion-cannon4.rmc | grep -q "platform" ; then
+    echo "Error: Metadata not shown"
+    exit 1
+fi
+
+echo "Test that -r -u mirrors the directory tree"
+rm -rf test-unpack-dir
+mkdir test-unpack-dir
+"${RMC}" -r -j 2 -u test-unpack-dir test-songs 2>/dev/null
+if ! cmp test-pack-dir/meta test-unpack-dir/dlm2.ion-cannon4/meta ; then
+    echo "Error: Recursive unpack differs"
+    exit 1
+fi
+
+echo "Test that --entry unpacks one file of the container"
+rm -rf test-entry-dir
+mkdir test-entry-dir
+"${RMC}" -u test-entry-dir --entry=dlm2.ion-cannon4 \
+	 test-songs/dlm2.ion-cannon4.rmc 2>/dev/null
+if ! cmp test-pack-dir/files/dlm2.ion-cannon4 \
+     test-entry-dir/files/dlm2.ion-cannon4 ; then
+    echo "Error: Unpacked entry differs"
+    exit 1
+fi
+
+echo "Test that --entry finds a file in a container without a file index"
+"${RMC}" --no-file-index test-songs/dlm2.ion-cannon4 2>/dev/null
+rm -rf test-entry-dir
+mkdir test-entry-dir
+"${RMC}" -u test-entry-dir --entry=dlm2.ion-cannon4 \
+	 test-songs/dlm2.ion-cannon4.rmc 2>/dev/null
+if ! cmp test-pack-dir/files/dlm2.ion-cannon4 \
+     test-entry-dir/files/dlm2.ion-cannon4 ; then
+    echo "Error: Unpacked entry differs without a file index"
+    exit 1
+fi
+
+echo "Test that --index lists the meta of containers"
+rm -f test.idx
+"${RMC}" --index=test.idx test-songs 2>/dev/null
+if ! "${RMC}" --index-list test.idx dlm2.ion-cannon4.rmc | grep -q "^dlm2" ; then
+    echo "Error: Container not in the index"
+    exit 1
+fi
+
+echo "Test that --modland fills authors from the md5 list"
+echo "$(md5sum < test-songs/dlm2.ion-cannon4 | cut -c1-32) Delta Music 2/Test Author/ion-cannon4.dlm2" > test-md5.txt
+"${RMC}" --modland=test-md5.txt test-songs/dlm2.ion-cannon4 2>/dev/null
+if ! "${RMC}" -s test-songs/dlm2.ion-cannon4.rmc | grep -q "Test Author" ; then
+    echo "Error: Authors not filled from the md5 list"
+    exit 1
+fi
+
+echo "Test that file hashes are only written with --store"
+"${RMC}" test-songs/dlm2.ion-cannon4 2>/dev/null
+if "${RMC}" -s test-songs/dlm2.ion-cannon4.rmc | grep -q "file_hashes" ; then
+    echo "Error: File hashes in meta without --store"
+    exit 1
+fi
+
+echo "Test that -u --store restores stored files"
+rm -rf test-store test-store-dir test-store-unpack-dir
+"${RMC}" --store=test-store test-songs/dlm2.ion-cannon4 2>/dev/null
+hash=$("${RMC}" -s test-songs/dlm2.ion-cannon4.rmc | grep -o "[0-9a-f]\{32\}")
+mkdir -p test-store/${hash:0:2} test-store-dir/files test-store-unpack-dir
+cp test-songs/dlm2.ion-cannon4 test-store/${hash:0:2}/${hash:2}
+echo "{'file_hashes': {'extra': '${hash}'}, 'platform': 'amiga', 'song': 'dlm2.ion-cannon4', 'stored_files': ['extra'], 'subsongs': {}}" > test-store-dir/meta
+cp test-songs/dlm2.ion-cannon4 test-store-dir/files/
+"${RMC}" -p test-store-dir test-store.rmc 2>/dev/null
+"${RMC}" -u test-store-unpack-dir --store=test-store test-store.rmc 2>/dev/null
+if ! cmp test-songs/dlm2.ion-cannon4 test-store-unpack-dir/files/extra ; then
+    echo "Error: Stored file not restored"
+    exit 1
+fi
+
+echo "Test that -J 2 gives the same container as sequential conversion"
+"${RMC}" test-songs/dlm2.ion-cannon4 2>/dev/null
+cp test-songs/dlm2.ion-cannon4.rmc test-sequential.rmc
+"${RMC}" -J 2 test-songs/dlm2.ion-cannon4 2>/dev/null
+if ! cmp test-sequential.rmc test-songs/dlm2.ion-cannon4.rmc ; then
+    echo "Error: -J 2 output differs"
+    exit 1
+fi
+
+echo "Test that a bundle with a corrupted footer is rejected"
+rm -f test.bnd
+"${RMC}" --bundle-create=test.bnd test-songs/dlm2.ion-cannon4.rmc 2>/dev/null
+size=$(stat -c %s test.bnd)
+printf '\xff\xff\xff\xff\xff\xff\xff\xff' | \
+    dd of=test.bnd bs=1 seek=$((size - 16)) conv=notrunc 2>/dev/null
+if "${RMC}" --bundle-list test.bnd 2>/dev/null ; then
+    echo "Error: Corrupted bundle accepted"
+    exit 1
+fi
+
+echo "Test that a bundle lists, extracts and appends containers"
+rm -rf test.bnd test-bundle-dir test-extract-dir
+mkdir -p test-bundle-dir/sub
+"${RMC}" --bundle-create=test.bnd test-songs/dlm2.ion-cannon4.rmc 2>/dev/null
+if ! "${RMC}" --bundle-list test.bnd | grep -q "^dlm2.ion-cannon4.rmc" ; then
+    echo "Error: Container not listed in the bundle"
+    exit 1
+fi
+"${RMC}" --bundle-extract=test-extract-dir test.bnd 2>/dev/null
+if ! cmp test-songs/dlm2.ion-cannon4.rmc \
+     test-extract-dir/dlm2.ion-cannon4.rmc ; then
+    echo "Error: Extracted container differs"
+    exit 1
+fi
+cp test-songs/dlm2.ion-cannon4.rmc test-bundle-dir/sub/appended.rmc
+"${RMC}" --bundle-append=test.bnd test-bundle-dir 2>/dev/null
+if ! "${RMC}" --bundle-list test.bnd | grep -q "^sub/appended.rmc" ; then
+    echo "Error: Appended container not listed in the bundle"
+    exit 1
+fi
+rm -rf test-extract-dir
+"${RMC}" --bundle-extract=test-extract-dir test.bnd 2>/dev/null
+if ! cmp test-songs/dlm2.ion-cannon4.rmc \
+     test-extract-dir/dlm2.ion-cannon4.rmc ||
+   ! cmp test-songs/dlm2.ion-cannon4.rmc \
+     test-extract-dir/sub/appended.rmc ; then
+    echo "Error: Container differs after appending"
+    exit 1
+fi
+
+echo "Test that an index with a corrupted header is rejected"
+rm -f test.idx
+"${RMC}" --index=test.idx test-songs 2>/dev/null
+printf '\xff\xff\xff\xff\xff\xff\xff\xff' | \
+    dd of=test.idx bs=1 seek=16 conv=notrunc 2>/dev/null
+if "${RMC}" --index-list test.idx 2>/dev/null ; then
+    echo "Error: Corrupted index accepted"
+    exit 1
+fi